@@ -25,9 +25,15 @@
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <time.h>
 #include <libusb-1.0/libusb.h>
 
 #include "vfs301_proto.h"
+#include "vfs301_transport.h"
+#include "vfs301_sim.h"
+#include "vfs301_record.h"
+#include "vfs301_archive.h"
+#include "vfs301_writer.h"
 #include <unistd.h>
 
 #define min(a, b) (((a) < (b)) ? (a) : (b))
@@ -35,52 +41,121 @@
 /************************** USB STUFF *****************************************/
 
 /* signal handler flag */
-static int last_signal = 0;
+static volatile sig_atomic_t last_signal = 0;
 
-/* init state of the usb subsystem */
-static enum {
+/* the traffic of reader N is recorded to record_name.N */
+static const char *record_name = NULL;
+
+/* print the duration of each init step */
+static int print_init_steps = 0;
+
+/* store the scans (not done while looking for the minimal init) */
+static int store_scans = 1;
+
+/* the scans are written by it in the background - into archive_name, if
+ * set, instead of a file each */
+static vfs301_writer_t *writer = NULL;
+static const char *archive_name = NULL;
+
+/* the raw frames of the scans are written too */
+static int keep_raw = 0;
+
+/* init state of the usb device */
+enum reader_state {
 	STATE_NOTHING,
-	STATE_INIT,
 	STATE_OPEN,
 	STATE_CLAIMED,
 	STATE_CONFIGURED
-} state;
+};
+
+/* progress of the capture loop of a reader */
+enum reader_step {
+	STEP_INIT,
+	STEP_REQUEST,
+	STEP_WAIT,
+	STEP_SCAN,
+	STEP_STOPPED
+};
+
+/* one fingerprint reader, all of its state is kept here */
+typedef struct {
+	vfs301_dev_t dev;
+	enum reader_state state;
+	enum reader_step step;
+	
+	/* reader number (0 - first reader found) */
+	int id;
+	/* number of the next scan stored */
+	int scan_idx;
+	/* scans done, and how many to do (0 = until interrupted) */
+	int scans;
+	int scan_limit;
+	/* height of the last scan */
+	int last_height;
+	/* buffer of the writer the scan goes to, and the raw frames kept in it */
+	unsigned char *img_buf;
+	vfs301_raw_frames_t raw;
+	/* scans kept, rejected as noise while scanning (and the time spent on
+	 * them, in us), and too short */
+	int scans_kept;
+	int scans_rejected;
+	long long rejected_us;
+	int scans_short;
+	
+	/* where the device comes from, to open it again (see reader_open) */
+	struct libusb_context *ctx;
+	libusb_device *udev;
+	vfs301_sim_t *sim;
+	const vfs301_sim_params_t *sim_params;
+	/* the replayed device, if any */
+	vfs301_transport_t *replay;
+} reader_t;
 
-/* context object for libusb library */
-static struct libusb_context *ctx;
-static struct libusb_device_handle *devh;
+#define MAX_READERS 16
+
+/* shorter scans are thrown away */
+#define MIN_SCAN_HEIGHT 20
 
 static uint16_t usb_ids_supported[][2] = {
 	{0x138a, 0x0008}, /* vfs300 */
 	{0x138a, 0x0005}, /* vfs301 */
 };
 
-static void usb_init(void)
+static int usb_is_supported(libusb_device *udev)
 {
+	struct libusb_device_descriptor desc;
 	int i;
-	int r;
 	
-	assert(state == STATE_NOTHING);
+	if (libusb_get_device_descriptor(udev, &desc) != 0)
+		return 0;
 	
-	r = libusb_init(&ctx);
-	if (r != 0) {
-		fprintf(stderr, "Failed to initialise libusb\n");
-		return;
-	}
-	state = STATE_INIT;
-
 	for (i = 0; i < (sizeof(usb_ids_supported) / sizeof(usb_ids_supported[0])); i++) {
-		devh = libusb_open_device_with_vid_pid(
-			ctx, usb_ids_supported[i][0], usb_ids_supported[i][1]
-		);
-		if (devh != NULL)
-			break;
+		if (desc.idVendor == usb_ids_supported[i][0] &&
+			desc.idProduct == usb_ids_supported[i][1])
+			return 1;
 	}
-	if (devh == NULL) {
-		fprintf(stderr, "Can't open any validity device!\n");
+	
+	return 0;
+}
+
+static void usb_init(reader_t *reader, struct libusb_context *ctx, libusb_device *udev)
+{
+	struct libusb_device_handle *devh;
+	int i;
+	int r;
+	
+	assert(reader->state == STATE_NOTHING);
+	
+	r = libusb_open(udev, &devh);
+	if (r != 0) {
+		fprintf(stderr, "Can't open validity device %d (%d)!\n", reader->id, r);
 		return;
 	}
-	state = STATE_OPEN;
+	reader->dev.devh = devh;
+	reader->dev.ctx = ctx;
+	reader->state = STATE_OPEN;
+	reader->dev.transport = vfs301_transport_libusb_new(ctx, devh);
+	assert(reader->dev.transport != NULL);
 
 	for (i = 0; i < 1000000; i++){
 		r = libusb_kernel_driver_active(devh, i);
@@ -96,7 +171,7 @@ static void usb_init(void)
 		fprintf(stderr, "usb_claim_interface error %d\n", r);
 		return;
 	}
-	state = STATE_CLAIMED;
+	reader->state = STATE_CLAIMED;
 
 	r = libusb_reset_device(devh);
 	if (r != 0) {
@@ -112,141 +187,508 @@ static void usb_init(void)
 		fprintf(stderr, "device configuring error %d\n", r);
 		return;
 	}
-	state = STATE_CONFIGURED;
+	reader->state = STATE_CONFIGURED;
 }
 
-static void usb_deinit(void)
+static void usb_deinit(reader_t *reader)
 {
+	struct libusb_device_handle *devh = reader->dev.devh;
 	int r;
 
-	if (state == STATE_CONFIGURED) {
+	if (reader->state == STATE_CONFIGURED) {
 		r = libusb_reset_device(devh); 
 		if (r != 0)
 			fprintf(stderr, "Failed to reset device\n");
-		state = STATE_CLAIMED;
+		reader->state = STATE_CLAIMED;
 	}
 
-	if (state == STATE_CLAIMED) {
+	if (reader->state == STATE_CLAIMED) {
 		r = libusb_release_interface(devh, 0);
 		if (r != 0)
 			fprintf(stderr, "Failed to release interface (%d)\n", r);
-		state = STATE_OPEN;
+		reader->state = STATE_OPEN;
 	}
 
-	if (state == STATE_OPEN) {
+	if (reader->state == STATE_OPEN) {
 		libusb_close(devh);
-		devh = NULL;
-		state = STATE_INIT;
+		reader->dev.devh = NULL;
+		reader->state = STATE_NOTHING;
 	}
+}
 
-	if (state == STATE_INIT) {
-		libusb_exit(ctx);
-		ctx = NULL;
-		state = STATE_NOTHING;
+/******************************* OUTPUT ***************************************/
+
+/** The scan is built right in a buffer of the writer */
+static void img_prepare(reader_t *reader)
+{
+	if (writer == NULL || reader->img_buf != NULL)
+		return;
+	
+	reader->img_buf = vfs301_writer_get(writer);
+	reader->dev.img_output = reader->img_buf;
+	reader->dev.img_output_lines = vfs301_writer_lines(writer);
+	
+	/* the raw frames go behind the image */
+	if (keep_raw) {
+		vfs301_raw_frames_init(&reader->raw,
+			reader->img_buf + reader->dev.img_output_lines * VFS301_FP_OUTPUT_WIDTH,
+			reader->dev.img_output_lines);
+		reader->dev.raw = &reader->raw;
 	}
 }
 
-/******************************* OUTPUT ***************************************/
+/** The scan as it goes to the writer */
+static void img_describe(reader_t *reader, vfs301_archive_scan_t *scan)
+{
+	vfs301_dev_t *dev = &reader->dev;
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_REALTIME, &ts);
+	
+	memset(scan, 0, sizeof(*scan));
+	scan->time_us = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+	scan->reader = reader->id;
+	scan->flags = VFS301_FP_OUTPUT_WIDTH == VFS301_FP_FRAME_SIZE ? VFS301_ARCHIVE_RAW : 0;
+	scan->width = VFS301_FP_OUTPUT_WIDTH;
+	scan->data = vfs301_image(dev, &scan->height);
+	scan->scanlines = dev->scanline_count;
+	scan->received = dev->frames_received;
+	scan->dropped = dev->frames_dropped;
+	scan->resynced = dev->frames_resynced;
+	scan->lift_line = dev->lift_line;
+	scan->gate_result = dev->gate_result;
+}
 
-static void img_store(vfs301_dev_t *dev)
+static void img_store(reader_t *reader)
 {
-	static int idx = 0;
+	vfs301_dev_t *dev = &reader->dev;
+	vfs301_archive_scan_t scan;
 	char fn[32];
-	FILE *f;
-	unsigned char *img;
 	int height;
 	
-	img = malloc(dev->scanline_count * VFS301_FP_OUTPUT_WIDTH);
+	vfs301_image(dev, &height);
+	reader->last_height = height;
 	
-	vfs301_extract_image(dev, img, &height);
-	
-	if (height > 20) {
-		sprintf(fn, "scan_%02d.pgm", idx++);
-		
-		f = fopen(fn, "wb");
-		assert(f != NULL);
+	if (!store_scans) {
+		fprintf(stderr, "[%d] got %dx%d px\n", reader->id, VFS301_FP_WIDTH, height);
+	} else if (height > MIN_SCAN_HEIGHT) {
+		if (reader->id == 0)
+			sprintf(fn, "scan_%02d.pgm", reader->scan_idx++);
+		else
+			sprintf(fn, "scan%d_%02d.pgm", reader->id, reader->scan_idx++);
 		
-		fprintf(f, "P5\n%d %d\n255\n", VFS301_FP_OUTPUT_WIDTH, height);
-		fwrite(img, height * VFS301_FP_OUTPUT_WIDTH, 1, f);
-		fclose(f);
+		/* the writer takes the buffer, the next scan gets another one */
+		img_describe(reader, &scan);
+		vfs301_writer_put(writer, &scan, dev->raw, fn);
+		reader->img_buf = NULL;
+		dev->img_output = NULL;
+		dev->raw = NULL;
 	} else {
 		fprintf(stderr, 
-			"fingerprint too short (%dx%d px), ignoring...\n", 
-			VFS301_FP_WIDTH, height
+			"[%d] fingerprint too short (%dx%d px), ignoring...\n", 
+			reader->id, VFS301_FP_WIDTH, height
 		);
 	}
-	
-	free(img);
 }
 
 /************************** GENERIC STUFF *************************************/
 
-static vfs301_dev_t dev;
+static void record_start(reader_t *reader)
+{
+	vfs301_transport_t *tr;
+	char fn[1024];
+	
+	if (record_name == NULL)
+		return;
+	
+	snprintf(fn, sizeof(fn), "%s.%d", record_name, reader->id);
+	tr = vfs301_record_new(reader->dev.transport, fn);
+	if (tr == NULL)
+		fprintf(stderr, "[%d] Can't record to %s\n", reader->id, fn);
+	else
+		reader->dev.transport = tr;
+}
+
+static void init_start(reader_t *reader)
+{
+	if (vfs301_proto_init_start(&reader->dev) < 0) {
+		fprintf(stderr, "[%d] Failed to initialize the device!\n", reader->id);
+		return;
+	}
+	reader->step = STEP_INIT;
+}
+
+static void init_report(reader_t *reader)
+{
+	vfs301_dev_t *dev = &reader->dev;
+	int i;
+	
+	fprintf(stderr, "[%d] initialized in %lld ms (%d replies timed out)\n",
+		reader->id, dev->init_us / 1000, dev->init_timeouts);
+	if (dev->calib_lines > 0)
+		fprintf(stderr, "[%d] flat field calibrated from %d lines%s\n", reader->id,
+			dev->calib_lines, dev->flat_field < 0 ? " (not used)" : "");
+	
+	if (!print_init_steps)
+		return;
+	
+	for (i = 0; i < vfs301_proto_init_steps(); i++) {
+		fprintf(stderr, "[%d]   %2d %-8s %6.2f ms\n", reader->id, i,
+			vfs301_proto_init_step_name(i), dev->init_step_us[i] / 1000.0);
+	}
+}
 
-static void init(vfs301_dev_t *dev)
+static void init(reader_t *reader, struct libusb_context *ctx, libusb_device *udev)
 {
-	state = STATE_NOTHING;
-	dev->scanline_buf = malloc(0);
-	dev->scanline_count = 0;
+	reader->state = STATE_NOTHING;
+	reader->step = STEP_STOPPED;
 	
-	usb_init();
-	if (state == STATE_CONFIGURED)
-		vfs301_proto_init(devh, dev);
+	usb_init(reader, ctx, udev);
+	if (reader->state == STATE_CONFIGURED) {
+		record_start(reader);
+		init_start(reader);
+	}
 }
 
-static void deinit(vfs301_dev_t *dev)
+/** Use a simulated or replayed device instead of a real one */
+static void init_virtual(reader_t *reader, vfs301_transport_t *tr)
 {
-	vfs301_proto_deinit(devh, dev);
-	usb_deinit();
+	reader->state = STATE_NOTHING;
+	reader->step = STEP_STOPPED;
+	
+	reader->dev.transport = tr;
+	if (reader->dev.transport != NULL) {
+		record_start(reader);
+		init_start(reader);
+	} else {
+		fprintf(stderr, "[%d] Can't set up the device!\n", reader->id);
+	}
+}
 
-	free(dev->scanline_buf);
+/** (Re)open the device of the reader, as set up in main() */
+static void reader_open(reader_t *reader)
+{
+	if (reader->sim != NULL)
+		init_virtual(reader, vfs301_sim_device_new(reader->sim, reader->sim_params));
+	else
+		init(reader, reader->ctx, reader->udev);
+}
+
+static void deinit(reader_t *reader)
+{
+	if (reader->img_buf != NULL) {
+		vfs301_writer_release(writer, reader->img_buf);
+		reader->img_buf = NULL;
+		reader->dev.img_output = NULL;
+		reader->dev.raw = NULL;
+	}
+	vfs301_proto_deinit(&reader->dev);
+	usb_deinit(reader);
+	vfs301_transport_free(reader->dev.transport);
+	reader->dev.transport = NULL;
 }
 
-static void work(vfs301_dev_t *dev)
+/** Advance the capture loop of the reader, never blocks for long. */
+static void reader_step(reader_t *reader)
 {
+	vfs301_dev_t *dev = &reader->dev;
 	int rv;
+	
+	switch (reader->step) {
+	case STEP_INIT:
+		rv = vfs301_proto_init_poll(dev);
+		if (rv == VFS301_ONGOING)
+			break;
+		
+		if (rv != VFS301_ENDED) {
+			fprintf(stderr, "[%d] Failed to initialize the device!\n", reader->id);
+			reader->step = STEP_STOPPED;
+			break;
+		}
+		
+		init_report(reader);
+		reader->step = (last_signal == 0) ? STEP_REQUEST : STEP_STOPPED;
+		break;
+	
+	case STEP_REQUEST:
+		fprintf(stderr, "[%d] waiting for next fingerprint...\n", reader->id);
+		vfs301_proto_request_fingerprint(dev);
+		if (vfs301_proto_wait_event_start(dev, NULL, NULL) < 0) {
+			fprintf(stderr, "[%d] Failed waiting for the finger...\n", reader->id);
+			reader->step = STEP_STOPPED;
+			break;
+		}
+		reader->step = STEP_WAIT;
+		break;
+	
+	case STEP_WAIT:
+		if (last_signal != 0)
+			vfs301_proto_wait_event_cancel(dev);
+		
+		rv = vfs301_proto_wait_event_poll(dev);
+		if (rv == VFS301_ONGOING)
+			break;
+		
+		if (rv != VFS301_ENDED) {
+			if (last_signal == 0)
+				fprintf(stderr, "[%d] Failed waiting for the finger...\n", reader->id);
+			reader->step = STEP_STOPPED;
+			break;
+		}
+		
+		fprintf(stderr, "[%d] finger detected within %lld ms, reading fingerprint...\n", 
+			reader->id, dev->event_latency / 1000);
+		img_prepare(reader);
+		vfs301_proto_process_event_start(dev);
+		reader->step = STEP_SCAN;
+		break;
+	
+	case STEP_SCAN:
+		rv = vfs301_proto_process_event_poll(dev);
+		if (rv == VFS301_ONGOING)
+			break;
+		
+		if (rv == VFS301_FAILURE) {
+			fprintf(stderr, "[%d] There was some failure during fingerprint scan...\n", 
+				reader->id);
+			reader->step = STEP_STOPPED;
+			break;
+		}
+		
+		fprintf(stderr, "[%d] %d blocks received, data endpoint idle %d times\n",
+			reader->id, dev->recv_blocks, dev->recv_idle_gaps);
+		if (dev->lift_line >= 0)
+			fprintf(stderr, "[%d] finger gone at line %d, detected after %lld ms, "
+				"scan over %lld ms later\n", reader->id, dev->lift_line,
+				dev->lift_us / 1000, dev->stop_us / 1000);
+		fprintf(stderr, "[%d] scan finished in %lld ms, %d replies taken out of "
+			"order\n", reader->id, dev->finish_us / 1000, dev->finish_reordered);
+		if (dev->resample)
+			fprintf(stderr, "[%d] finger speed found in %d of %d frames\n",
+				reader->id, dev->motion_found, dev->scanline_count);
+		fprintf(stderr, "[%d] %d frames received, %d dropped (at most %d in a row), "
+			"stream out of sync %d times\n", reader->id, dev->frames_received,
+			dev->frames_dropped, dev->frames_max_gap, dev->frames_resynced);
+		if (dev->scanline_dropped > 0)
+			fprintf(stderr, "[%d] %d scanlines over the limit dropped\n", 
+				reader->id, dev->scanline_dropped);
+		
+		if (dev->gate_result > VFS301_GATE_PASSED) {
+			fprintf(stderr, "[%d] %s, scan rejected after %lld ms, "
+				"scan over %lld ms later\n", reader->id,
+				dev->gate_result == VFS301_GATE_NOISE ? "noise" : "no finger",
+				dev->gate_us / 1000, dev->stop_us / 1000);
+			reader->last_height = 0;
+			reader->scans_rejected++;
+			reader->rejected_us += dev->gate_us + dev->stop_us;
+		} else {
+			img_store(reader);
+			if (reader->last_height > MIN_SCAN_HEIGHT)
+				reader->scans_kept++;
+			else
+				reader->scans_short++;
+		}
+		
+		reader->scans++;
+		if (last_signal != 0 || 
+			(reader->scan_limit > 0 && reader->scans >= reader->scan_limit))
+			reader->step = STEP_STOPPED;
+		else
+			reader->step = STEP_REQUEST;
+		break;
+	
+	case STEP_STOPPED:
+		break;
+	}
+}
+
+/** How many of the scans were good */
+static void reader_report(reader_t *reader)
+{
+	int scans = reader->scans;
+	
+	if (scans == 0)
+		return;
+	
+	fprintf(stderr, "[%d] %d scans: %d kept (%d%%), %d rejected while scanning "
+		"(%d%%, %lld ms spent on them), %d too short (%d%%)\n", reader->id,
+		reader->scans, reader->scans_kept, 100 * reader->scans_kept / scans,
+		reader->scans_rejected, 100 * reader->scans_rejected / scans,
+		reader->rejected_us / 1000,
+		reader->scans_short, 100 * reader->scans_short / scans);
+}
+
+/** Waits for the rest of the scans to be written, and tells how it went */
+static void writer_report(void)
+{
+	vfs301_writer_stats_t stats;
+	
+	vfs301_writer_flush(writer);
+	vfs301_writer_stats(writer, &stats);
+	
+	fprintf(stderr, "[writer] %d scans written%s%s in %d batches (at most %d at once), "
+		"%d failed; the capture waited for the writer %d times\n", stats.written,
+		archive_name ? " to " : "", archive_name ? archive_name : "",
+		stats.batches, stats.max_batch, stats.errors, stats.waits);
+}
+
+/** Drive all the readers from a single event loop (the readers share the
+ * transport context - either libusb or the simulator) */
+static void work(reader_t *readers, int count)
+{
 	const char *progress[] = {"/\r", "-\r", "\\\r", "|\r", NULL};
 	const char **cprogress = progress;
+	vfs301_transport_t *tr = NULL;
+	struct timeval tv;
+	int timeout;
+	int running;
+	int scanning;
+	int i;
+	int r;
 	
-	while (last_signal == 0) {
-		fprintf(stderr, "waiting for next fingerprint...\n");
-		vfs301_proto_request_fingerprint(devh, dev);
-
-		while (last_signal == 0 && !vfs301_proto_peek_event(devh, dev)) {
-			usleep(200000);
+	for (i = 0; i < count && tr == NULL; i++)
+		tr = readers[i].dev.transport;
+	
+	do {
+		running = 0;
+		scanning = 0;
+		timeout = VFS301_EVENT_POLL_MAX;
+		
+		for (i = 0; i < count; i++) {
+			reader_step(&readers[i]);
+			
+			switch (readers[i].step) {
+			case STEP_WAIT:
+				timeout = min(timeout, vfs301_proto_wait_event_timeout(&readers[i].dev));
+				running++;
+				break;
+			case STEP_INIT:
+				running++;
+				break;
+			case STEP_SCAN:
+				timeout = min(timeout, 2);
+				scanning++;
+				running++;
+				break;
+			case STEP_REQUEST:
+				timeout = 0;
+				running++;
+				break;
+			case STEP_STOPPED:
+				break;
+			}
+		}
+		
+		if (scanning > 0) {
+			// fancy progress meter :)
+			fputs(*cprogress, stdout);
+			fflush(stdout);
+			cprogress++;
+			if (*cprogress == NULL)
+				cprogress = progress;
 		}
+		
+		if (running > 0) {
+			tv.tv_sec = timeout / 1000;
+			tv.tv_usec = (timeout % 1000) * 1000;
+			r = tr->handle_events(tr, &tv);
+			assert(r == 0 || r == LIBUSB_ERROR_INTERRUPTED);
+		}
+	} while (running > 0);
+}
 
-		if (last_signal == 0) {
-			fprintf(stderr, "reading fingerprint...\n");
-			vfs301_proto_process_event_start(devh, dev);
+/************************** MINIMAL INIT SEARCH *******************************/
+
+/* Nobody knows which init messages are really needed - so leave some of
+ * them out, and see whether the device still scans (a finger has to be
+ * swiped for each try). Chunks of the init steps are left out, halving the
+ * chunks until single steps are tried (as in delta debugging); the result
+ * is a sequence where no single step can be left out anymore. */
+
+/** Open the device with the given steps skipped, and scan once */
+static int search_try(reader_t *reader, unsigned long long skip, int max_timeouts)
+{
+	vfs301_dev_t *dev = &reader->dev;
+	int ok;
+	
+	fprintf(stderr, "[search] trying without 0x%llx, swipe the finger...\n", skip);
+	
+	dev->init_skip = skip;
+	reader->scans = 0;
+	reader->scan_limit = 1;
+	reader->last_height = 0;
+	
+	reader_open(reader);
+	work(reader, 1);
+	
+	ok = dev->init_progress == VFS301_ENDED && 
+		dev->init_timeouts <= max_timeouts &&
+		reader->scans == 1 && reader->last_height > MIN_SCAN_HEIGHT;
+	
+	deinit(reader);
+	return ok;
+}
+
+static void search_init(reader_t *reader)
+{
+	int count = vfs301_proto_init_steps();
+	unsigned long long skip = 0;
+	unsigned long long bits;
+	long long full_us;
+	int max_timeouts;
+	int chunk;
+	int removed;
+	int tries = 1;
+	int i;
+	int j;
+	
+	store_scans = 0;
+	
+	if (!search_try(reader, 0, count)) {
+		fprintf(stderr, "[search] the device doesn't work even with the full init!\n");
+		return;
+	}
+	full_us = reader->dev.init_us;
+	max_timeouts = reader->dev.init_timeouts;
+	
+	for (chunk = (count + 1) / 2; chunk > 0 && last_signal == 0; ) {
+		removed = 0;
+		
+		for (i = 0; i < count && last_signal == 0; i += chunk) {
+			bits = 0;
+			for (j = i; j < min(i + chunk, count); j++)
+				bits |= 1ULL << j;
+			
+			if ((skip & bits) == bits)
+				continue;
 			
-			rv = VFS301_ONGOING;
-			while (rv == VFS301_ONGOING) {
-				assert(libusb_handle_events(ctx) == 0);
-				
-				rv = vfs301_proto_process_event_poll(devh, dev);
-				
-				// fancy progress meter :)
-				fputs(*cprogress, stdout);
-				fflush(stdout);
-				cprogress++;
-				if (*cprogress == NULL)
-					cprogress = progress;
-				
-				if (rv == VFS301_FAILURE) {
-					fprintf(stderr, "There was some failure during fingerprint scan...\n");
-					goto exit;
-				}
-				usleep(2000);
+			tries++;
+			if (search_try(reader, skip | bits, max_timeouts)) {
+				skip |= bits;
+				removed = 1;
 			}
-
-			img_store(dev);
 		}
+		
+		/* single steps are retried while any of them goes away */
+		if (chunk > 1 || !removed)
+			chunk /= 2;
 	}
-
-exit:
-	fprintf(stderr, "That was all, folks\n");
-	deinit(dev);
+	
+	if (last_signal != 0) {
+		fprintf(stderr, "[search] interrupted\n");
+		return;
+	}
+	
+	/* once more, for the timings */
+	search_try(reader, skip, max_timeouts);
+	
+	printf("Minimal init found after %d tries, %lld ms instead of %lld ms:\n",
+		tries, reader->dev.init_us / 1000, full_us / 1000);
+	for (i = 0; i < count; i++) {
+		if (!((skip >> i) & 1))
+			printf("  %2d %s\n", i, vfs301_proto_init_step_name(i));
+	}
+	printf("Use it by -I 0x%llx\n", skip);
 }
 
 static void handle_signal(int sig)
@@ -255,16 +697,289 @@ static void handle_signal(int sig)
 		last_signal = sig;
 }
 
+static void usage(const char *name, const vfs301_sim_params_t *sim_params)
+{
+	fprintf(stderr, 
+		"Usage: %s [-t transfers] [-m lines] [-n readers] [-c scans]\n"
+		"       [-s readers [-r rate] [-l latency] [-e lines] [-g frames] [-N scans]\n"
+		"        [-f swipe.pgm]]\n"
+		"       [-W archive] [-D] [-R name] [-P recording [-P ...] [-a]] [-i] [-I mask]\n"
+		"       [-S] [-b steps]\n"
+		"       [-L] [-A] [-M | -C] [-F]\n"
+		"  -t N  number of bulk transfers queued during the scan (1-%d, default %d)\n"
+		"  -m N  maximum number of scanlines used per scan (default %d)\n"
+		"  -n N  maximum number of readers used at once (default %d)\n"
+		"  -c N  stop each reader after N scans\n"
+		"  -s N  use N simulated readers instead of the real ones\n"
+		"  -r N  simulated line rate (lines/s, 0 = unlimited, default %d)\n"
+		"  -l N  simulated USB latency (us, default %d)\n"
+		"  -e N  empty frames before and after the simulated swipe (default %d)\n"
+		"  -g N  cut every Nth simulated frame in half (lost data)\n"
+		"  -N N  every Nth simulated scan is noise\n"
+		"  -f F  swipe (pgm) sent by the simulated readers\n"
+		"  -W F  append all the scans to the archive F (see vfs301_arc)\n"
+		"  -D    write the raw frames of the scans too (scan_NN_raw.pgm, or to F)\n"
+		"  -R F  record the USB traffic of reader N to F.N\n"
+		"  -P F  replay the recorded reader F (may be repeated)\n"
+		"  -a    replay as fast as possible, instead of the original speed\n"
+		"  -i    print the duration of each init step\n"
+		"  -I M  leave out the init steps in the mask (bit N = step N)\n"
+		"  -S    look for the shortest init the first reader works with\n"
+		"  -b N  send up to N protocol messages at once (1-%d, default %d)\n"
+		"  -L    don't stop the scan when the finger is gone\n"
+		"  -A    don't reject the noise scans while scanning\n"
+		"  -M    resample the scans by the finger speed, instead of picking lines\n"
+		"  -C    the same, with the speed found by correlating the lines\n"
+		"  -F    don't apply the flat-field calibration\n",
+		name, VFS301_MAX_TRANSFERS, VFS301_DEFAULT_TRANSFERS,
+		VFS301_DEFAULT_MAX_SCANLINES, MAX_READERS,
+		sim_params->line_rate, sim_params->latency_us, sim_params->empty_lines,
+		VFS301_SEQ_MAX_BATCH, VFS301_SEQ_DEFAULT_BATCH
+	);
+}
+
 int main(int argc, char **argv)
 {
+	struct libusb_context *ctx;
+	libusb_device **list;
+	reader_t *readers;
+	vfs301_sim_t *sim = NULL;
+	vfs301_sim_params_t sim_params;
+	vfs301_replay_t *replay = NULL;
+	const char *replay_files[MAX_READERS];
+	int replay_count = 0;
+	int replay_realtime = 1;
+	unsigned char *swipe = NULL;
+	int transfer_count = 0;
+	int scanline_max = 0;
+	int max_readers = MAX_READERS;
+	int scan_limit = 0;
+	int sim_readers = 0;
+	unsigned long long init_skip = 0;
+	int seq_batch = 0;
+	int lift_lines = 0;
+	int gate = 0;
+	int resample = 0;
+	int flat_field = 0;
+	int search = 0;
+	int count = 0;
+	int opt;
+	int i;
+	ssize_t n;
+	
+	vfs301_sim_params_default(&sim_params);
+	
+	while ((opt = getopt(argc, argv, "t:m:n:c:s:r:l:e:g:N:f:W:DR:P:aiI:Sb:LAMCFh")) != -1) {
+		switch (opt) {
+		case 't':
+			transfer_count = atoi(optarg);
+			break;
+		case 'm':
+			scanline_max = atoi(optarg);
+			break;
+		case 'n':
+			max_readers = min(atoi(optarg), MAX_READERS);
+			break;
+		case 'c':
+			scan_limit = atoi(optarg);
+			break;
+		case 's':
+			sim_readers = min(atoi(optarg), MAX_READERS);
+			break;
+		case 'r':
+			sim_params.line_rate = atoi(optarg);
+			break;
+		case 'l':
+			sim_params.latency_us = atoi(optarg);
+			break;
+		case 'e':
+			sim_params.empty_lines = atoi(optarg);
+			break;
+		case 'g':
+			sim_params.glitch_frames = atoi(optarg);
+			break;
+		case 'N':
+			sim_params.noise_scans = atoi(optarg);
+			break;
+		case 'f':
+			free(swipe);
+			swipe = vfs301_sim_swipe_load(optarg, &sim_params.swipe_lines);
+			if (swipe == NULL) {
+				fprintf(stderr, "Can't load %s\n", optarg);
+				return 1;
+			}
+			sim_params.swipe = swipe;
+			break;
+		case 'W':
+			archive_name = optarg;
+			break;
+		case 'D':
+			keep_raw = 1;
+			break;
+		case 'R':
+			record_name = optarg;
+			break;
+		case 'P':
+			if (replay_count < MAX_READERS)
+				replay_files[replay_count++] = optarg;
+			break;
+		case 'a':
+			replay_realtime = 0;
+			break;
+		case 'i':
+			print_init_steps = 1;
+			break;
+		case 'I':
+			init_skip = strtoull(optarg, NULL, 0);
+			break;
+		case 'S':
+			search = 1;
+			max_readers = 1;
+			sim_readers = min(sim_readers, 1);
+			break;
+		case 'b':
+			seq_batch = atoi(optarg);
+			break;
+		case 'L':
+			lift_lines = -1;
+			break;
+		case 'A':
+			gate = -1;
+			break;
+		case 'M':
+			resample = VFS301_RESAMPLE_MIRROR;
+			break;
+		case 'C':
+			resample = VFS301_RESAMPLE_CORR;
+			break;
+		case 'F':
+			flat_field = -1;
+			break;
+		default:
+			usage(argv[0], &sim_params);
+			return 1;
+		}
+	}
+	
+	if (search && replay_count > 0) {
+		fprintf(stderr, "Can't look for the init on a replayed device!\n");
+		return 1;
+	}
+	
 	signal(SIGINT, handle_signal);
-	state = STATE_NOTHING;
 	
-	init(&dev);
+	if (libusb_init(&ctx) != 0) {
+		fprintf(stderr, "Failed to initialise libusb\n");
+		return 1;
+	}
+	
+	readers = calloc(MAX_READERS, sizeof(*readers));
+	assert(readers != NULL);
+	
+	if (replay_count > 0) {
+		replay = vfs301_replay_new();
+		assert(replay != NULL);
+		
+		for (count = 0; count < replay_count; count++) {
+			readers[count].id = count;
+			readers[count].scan_limit = scan_limit;
+			readers[count].dev.transfer_count = transfer_count;
+			readers[count].dev.scanline_max = scanline_max;
+			readers[count].dev.init_skip = init_skip;
+			readers[count].dev.seq_batch = seq_batch;
+			readers[count].dev.lift_lines = lift_lines;
+			readers[count].dev.gate = gate;
+			readers[count].dev.resample = resample;
+			readers[count].dev.flat_field = flat_field;
+			readers[count].replay = vfs301_replay_device_new(
+				replay, replay_files[count], replay_realtime);
+			init_virtual(&readers[count], readers[count].replay);
+		}
+	} else if (sim_readers > 0) {
+		sim = vfs301_sim_new();
+		assert(sim != NULL);
+		
+		for (count = 0; count < sim_readers; count++) {
+			readers[count].id = count;
+			readers[count].scan_limit = scan_limit;
+			readers[count].dev.transfer_count = transfer_count;
+			readers[count].dev.scanline_max = scanline_max;
+			readers[count].dev.init_skip = init_skip;
+			readers[count].dev.seq_batch = seq_batch;
+			readers[count].dev.lift_lines = lift_lines;
+			readers[count].dev.gate = gate;
+			readers[count].dev.resample = resample;
+			readers[count].dev.flat_field = flat_field;
+			readers[count].sim = sim;
+			readers[count].sim_params = &sim_params;
+		}
+	} else {
+		n = libusb_get_device_list(ctx, &list);
+		for (i = 0; i < n && count < max_readers; i++) {
+			if (!usb_is_supported(list[i]))
+				continue;
+			
+			readers[count].id = count;
+			readers[count].scan_limit = scan_limit;
+			readers[count].dev.transfer_count = transfer_count;
+			readers[count].dev.scanline_max = scanline_max;
+			readers[count].dev.init_skip = init_skip;
+			readers[count].dev.seq_batch = seq_batch;
+			readers[count].dev.lift_lines = lift_lines;
+			readers[count].dev.gate = gate;
+			readers[count].dev.resample = resample;
+			readers[count].dev.flat_field = flat_field;
+			readers[count].ctx = ctx;
+			readers[count].udev = libusb_ref_device(list[i]);
+			count++;
+		}
+		if (n >= 0)
+			libusb_free_device_list(list, 1);
+	}
+	
+	if (count == 0) {
+		fprintf(stderr, "Can't open any validity device!\n");
+	} else if (search) {
+		search_init(&readers[0]);
+	} else {
+		/* a buffer for each reader to scan to, and the queued ones */
+		writer = vfs301_writer_new(archive_name,
+			scanline_max > 0 ? scanline_max : VFS301_DEFAULT_MAX_SCANLINES,
+			VFS301_FP_OUTPUT_WIDTH + (keep_raw ? VFS301_FP_RAW_SIZE : 0),
+			count + VFS301_WRITER_QUEUE);
+		if (writer == NULL) {
+			fprintf(stderr, "Can't write the scans%s%s!\n",
+				archive_name ? " to " : "", archive_name ? archive_name : "");
+		} else {
+			for (i = 0; i < count && replay_count == 0; i++)
+				reader_open(&readers[i]);
+			work(readers, count);
+			for (i = 0; i < count; i++)
+				reader_report(&readers[i]);
+			writer_report();
+			fprintf(stderr, "That was all, folks\n");
+		}
+	}
+	
+	for (i = 0; i < count; i++) {
+		if (readers[i].replay != NULL && vfs301_replay_mismatches(readers[i].replay) > 0)
+			fprintf(stderr, "[%d] %d messages sent differ from the recording\n",
+				i, vfs301_replay_mismatches(readers[i].replay));
+		deinit(&readers[i]);
+		if (readers[i].udev != NULL)
+			libusb_unref_device(readers[i].udev);
+	}
+	free(readers);
+	
+	if (writer != NULL)
+		vfs301_writer_free(writer);
 	
-	if (state == STATE_CONFIGURED)
-		work(&dev);
+	if (sim != NULL)
+		vfs301_sim_free(sim);
+	if (replay != NULL)
+		vfs301_replay_free(replay);
+	free(swipe);
 	
-	if (state != STATE_NOTHING)
-		deinit(&dev);
+	libusb_exit(ctx);
+	return 0;
 }
@@ -0,0 +1,154 @@
+/*
+ * vfs301/vfs300 fingerprint reader driver
+ * https://github.com/andree182/vfs301
+ *
+ * Copyright (c) 2011-2012 Andrej Krutak <dev@andree.sk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Lists the scans in an archive written by the cli (-W), or extracts them.
+ *
+ * Usage: ./vfs301_arc [-q] archive       list the scans (-q: just the totals)
+ *        ./vfs301_arc -x N archive       write the Nth scan as PGM to stdout
+ *
+ * Of the raw frames stored by their fields, only the scans are extracted.
+ */
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vfs301_archive.h"
+
+static long long time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static const char *gate_names[] = {"-", "passed", "no finger", "noise"};
+
+static void list(const vfs301_archive_t *archive, int quiet)
+{
+	vfs301_archive_scan_t scan;
+	long long lines = 0;
+	long long sum = 0;
+	long long t;
+	int count = vfs301_archive_count(archive);
+	int damaged = 0;
+	int i;
+	int j;
+
+	if (!quiet)
+		printf("   #  reader  time                 size     frames  dropped  resynced  lift  gate\n");
+
+	t = time_ns();
+	for (i = 0; i < count; i++) {
+		if (vfs301_archive_scan(archive, i, &scan) < 0) {
+			damaged++;
+			continue;
+		}
+
+		/* every line is touched, as a reader of the scans would */
+		for (j = 0; j < scan.height; j++)
+			sum += scan.data[j * scan.width];
+		lines += scan.height;
+
+		if (quiet)
+			continue;
+
+		printf("%4d  %6d  %lld.%06lld  %3dx%-5d  %6d  %7d  %8d  %4d  %s%s\n",
+			i, scan.reader, scan.time_us / 1000000, scan.time_us % 1000000,
+			scan.width, scan.height, scan.received, scan.dropped, scan.resynced,
+			scan.lift_line, scan.gate_result < 4 ? gate_names[scan.gate_result] : "?",
+			(scan.flags & VFS301_ARCHIVE_RAW) ? " (raw)" : "");
+	}
+	t = time_ns() - t;
+
+	printf("%d scans (%d damaged), %lld lines, read in %.3f ms (%.0f scans/s, "
+		"checksum %lld)\n", count, damaged, lines, t / 1e6,
+		count / (t / 1e9 + 1e-9), sum);
+}
+
+static int extract(const vfs301_archive_t *archive, int n)
+{
+	vfs301_archive_scan_t scan;
+	const unsigned char *column;
+	int size;
+
+	if (n < 0 || n >= vfs301_archive_count(archive) ||
+		vfs301_archive_scan(archive, n, &scan) < 0
+	) {
+		fprintf(stderr, "No scan %d in the archive\n", n);
+		return 1;
+	}
+
+	column = vfs301_archive_column(&scan, VFS301_COLUMN_SCAN, &size);
+	if (column != NULL) {
+		scan.data = column;
+		scan.width = size;
+	}
+
+	printf("P5\n%d %d\n255\n", scan.width, scan.height);
+	fwrite(scan.data, scan.width * scan.height, 1, stdout);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	vfs301_archive_t *archive;
+	int quiet = 0;
+	int n = -1;
+	int opt;
+	int r = 0;
+
+	while ((opt = getopt(argc, argv, "qx:h")) != -1) {
+		switch (opt) {
+		case 'q':
+			quiet = 1;
+			break;
+		case 'x':
+			n = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-q | -x scan] archive\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind + 1 != argc) {
+		fprintf(stderr, "Usage: %s [-q | -x scan] archive\n", argv[0]);
+		return 1;
+	}
+
+	archive = vfs301_archive_open(argv[optind]);
+	if (archive == NULL) {
+		fprintf(stderr, "%s: not a vfs301 archive\n", argv[optind]);
+		return 1;
+	}
+
+	if (n >= 0)
+		r = extract(archive, n);
+	else
+		list(archive, quiet);
+
+	vfs301_archive_close(archive);
+	return r;
+}
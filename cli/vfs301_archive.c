@@ -0,0 +1,419 @@
+/*
+ * vfs301/vfs300 fingerprint reader driver
+ * https://github.com/andree182/vfs301
+ *
+ * Copyright (c) 2011-2012 Andrej Krutak <dev@andree.sk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "vfs301_archive.h"
+
+#define MAGIC_LEN 8
+#define TRAILER_LEN 16
+
+/* sizes of the VFS301_COLUMN_* */
+static const int column_sizes[VFS301_COLUMNS] = {2, 1, 200, 64, 16};
+#define COLUMNS_WIDTH (2 + 1 + 200 + 64 + 16)
+
+static void put_u32(unsigned char *p, unsigned int v)
+{
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+	p[2] = (v >> 16) & 0xFF;
+	p[3] = (v >> 24) & 0xFF;
+}
+
+static void put_u64(unsigned char *p, unsigned long long v)
+{
+	put_u32(p, v & 0xFFFFFFFF);
+	put_u32(p + 4, v >> 32);
+}
+
+static unsigned int get_u32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static unsigned long long get_u64(const unsigned char *p)
+{
+	return get_u32(p) | ((unsigned long long)get_u32(p + 4) << 32);
+}
+
+/************************** READING *******************************************/
+
+struct vfs301_archive {
+	const unsigned char *map;
+	size_t size;
+	/* offsets of the records - the index in the file, or the ones found by
+	 * walking the records when there is none */
+	const unsigned char *index;
+	long long *offsets;
+	int count;
+	/* end of the last record */
+	size_t end;
+};
+
+/** Whether there is a whole record at pos, returns its length (0 if not) */
+static size_t archive_record_at(const vfs301_archive_t *a, size_t pos)
+{
+	const unsigned char *p = a->map + pos;
+	size_t length;
+
+	if (pos % 8 != 0 || pos + VFS301_ARCHIVE_HEADER_LEN > a->size ||
+		get_u32(p) != VFS301_ARCHIVE_RECORD)
+		return 0;
+
+	length = get_u32(p + 4);
+	if (length < VFS301_ARCHIVE_HEADER_LEN || length % 8 != 0 || length > a->size - pos)
+		return 0;
+
+	return length;
+}
+
+/** Use the index at the end of the file, if there is one */
+static int archive_read_index(vfs301_archive_t *a)
+{
+	const unsigned char *trailer = a->map + a->size - TRAILER_LEN;
+	unsigned long long index;
+	unsigned int count;
+
+	if (a->size < MAGIC_LEN + TRAILER_LEN || get_u32(trailer + 12) != VFS301_ARCHIVE_INDEX)
+		return 0;
+
+	index = get_u64(trailer);
+	count = get_u32(trailer + 8);
+	if (index < MAGIC_LEN || index % 8 != 0 ||
+		index + 8ULL * count + TRAILER_LEN != a->size)
+		return 0;
+
+	a->index = a->map + index;
+	a->count = count;
+	a->end = index;
+	return 1;
+}
+
+/** Find the records one after another, up to the first broken one */
+static int archive_walk(vfs301_archive_t *a)
+{
+	size_t pos = MAGIC_LEN;
+	size_t length;
+	int capacity = 0;
+	long long *offsets;
+
+	while ((length = archive_record_at(a, pos)) > 0) {
+		if (a->count == capacity) {
+			capacity = capacity ? 2 * capacity : 1024;
+			offsets = realloc(a->offsets, capacity * sizeof(*offsets));
+			if (offsets == NULL)
+				return -1;
+			a->offsets = offsets;
+		}
+		a->offsets[a->count++] = pos;
+		pos += length;
+	}
+
+	a->end = pos;
+	return 0;
+}
+
+vfs301_archive_t *vfs301_archive_open(const char *fn)
+{
+	vfs301_archive_t *a;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(fn, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) != 0 || st.st_size < MAGIC_LEN) {
+		close(fd);
+		return NULL;
+	}
+
+	/* the mapping stays valid without the descriptor */
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	a = calloc(1, sizeof(*a));
+	if (a == NULL) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	a->map = map;
+	a->size = st.st_size;
+
+	if (memcmp(a->map, VFS301_ARCHIVE_MAGIC, MAGIC_LEN) != 0 ||
+		(!archive_read_index(a) && archive_walk(a) < 0)
+	) {
+		vfs301_archive_close(a);
+		return NULL;
+	}
+
+	return a;
+}
+
+void vfs301_archive_close(vfs301_archive_t *a)
+{
+	munmap((void *)a->map, a->size);
+	free(a->offsets);
+	free(a);
+}
+
+int vfs301_archive_count(const vfs301_archive_t *a)
+{
+	return a->count;
+}
+
+static long long archive_offset(const vfs301_archive_t *a, int n)
+{
+	return a->index != NULL ? (long long)get_u64(a->index + 8 * n) : a->offsets[n];
+}
+
+int vfs301_archive_scan(const vfs301_archive_t *a, int n, vfs301_archive_scan_t *scan)
+{
+	const unsigned char *p;
+	long long pos;
+	size_t length;
+
+	assert(n >= 0 && n < a->count);
+
+	pos = archive_offset(a, n);
+	if (pos < MAGIC_LEN || (size_t)pos >= a->end)
+		return -1;
+	length = archive_record_at(a, pos);
+	if (length == 0)
+		return -1;
+	p = a->map + pos;
+
+	scan->time_us = get_u64(p + 8);
+	scan->reader = get_u32(p + 16);
+	scan->flags = get_u32(p + 20);
+	scan->width = get_u32(p + 24);
+	scan->height = get_u32(p + 28);
+	scan->scanlines = get_u32(p + 32);
+	scan->received = get_u32(p + 36);
+	scan->dropped = get_u32(p + 40);
+	scan->resynced = get_u32(p + 44);
+	scan->lift_line = (int)get_u32(p + 48);
+	scan->gate_result = get_u32(p + 52);
+	scan->data = p + VFS301_ARCHIVE_HEADER_LEN;
+
+	if (scan->width < 0 || scan->height < 0 ||
+		(unsigned long long)scan->width * scan->height > length - VFS301_ARCHIVE_HEADER_LEN)
+		return -1;
+
+	return 0;
+}
+
+const unsigned char *vfs301_archive_column(
+	const vfs301_archive_scan_t *scan, int column, int *size)
+{
+	const unsigned char *p = scan->data;
+	int i;
+
+	assert(column >= 0 && column < VFS301_COLUMNS);
+
+	if (!(scan->flags & VFS301_ARCHIVE_COLUMNS) || scan->width != COLUMNS_WIDTH)
+		return NULL;
+
+	for (i = 0; i < column; i++)
+		p += (size_t)column_sizes[i] * scan->height;
+
+	*size = column_sizes[column];
+	return p;
+}
+
+/************************** WRITING *******************************************/
+
+struct vfs301_archive_writer {
+	FILE *f;
+	/* offsets of all the records, for the index */
+	long long *offsets;
+	int count;
+	int capacity;
+	/* where the next record goes */
+	long long pos;
+	int errors;
+};
+
+vfs301_archive_writer_t *vfs301_archive_append_start(const char *fn)
+{
+	vfs301_archive_writer_t *w;
+	vfs301_archive_t *a;
+	struct stat st;
+	int i;
+
+	w = calloc(1, sizeof(*w));
+	if (w == NULL)
+		return NULL;
+
+	if (stat(fn, &st) != 0 || st.st_size == 0) {
+		/* a new one */
+		w->f = fopen(fn, "wb");
+		if (w->f == NULL || fwrite(VFS301_ARCHIVE_MAGIC, MAGIC_LEN, 1, w->f) != 1)
+			goto fail;
+		w->pos = MAGIC_LEN;
+		return w;
+	}
+
+	/* the records already there stay, the index is written anew */
+	a = vfs301_archive_open(fn);
+	if (a == NULL)
+		goto fail;
+
+	w->capacity = a->count + 1024;
+	w->offsets = malloc(w->capacity * sizeof(*w->offsets));
+	if (w->offsets == NULL) {
+		vfs301_archive_close(a);
+		goto fail;
+	}
+	for (i = 0; i < a->count; i++)
+		w->offsets[i] = archive_offset(a, i);
+	w->count = a->count;
+	w->pos = a->end;
+	vfs301_archive_close(a);
+
+	w->f = fopen(fn, "r+b");
+	if (w->f == NULL || ftruncate(fileno(w->f), w->pos) != 0 ||
+		fseek(w->f, w->pos, SEEK_SET) != 0)
+		goto fail;
+
+	return w;
+
+fail:
+	if (w->f != NULL)
+		fclose(w->f);
+	free(w->offsets);
+	free(w);
+	return NULL;
+}
+
+int vfs301_archive_append(
+	vfs301_archive_writer_t *w, const vfs301_archive_scan_t *scan)
+{
+	size_t len = (size_t)scan->width * scan->height;
+
+	return vfs301_archive_append_parts(w, scan, &scan->data, &len, 1);
+}
+
+int vfs301_archive_append_parts(
+	vfs301_archive_writer_t *w, const vfs301_archive_scan_t *scan,
+	const unsigned char *const *parts, const size_t *lens, int count)
+{
+	static const unsigned char padding[8];
+	unsigned char hdr[VFS301_ARCHIVE_HEADER_LEN];
+	size_t data_len = (size_t)scan->width * scan->height;
+	size_t length = (VFS301_ARCHIVE_HEADER_LEN + data_len + 7) & ~(size_t)7;
+	size_t pad = length - VFS301_ARCHIVE_HEADER_LEN - data_len;
+	size_t parts_len = 0;
+	long long *offsets;
+	int i;
+
+	for (i = 0; i < count; i++)
+		parts_len += lens[i];
+	assert(parts_len == data_len);
+
+	if (w->count == w->capacity) {
+		w->capacity = w->capacity ? 2 * w->capacity : 1024;
+		offsets = realloc(w->offsets, w->capacity * sizeof(*offsets));
+		if (offsets == NULL)
+			return -1;
+		w->offsets = offsets;
+	}
+
+	put_u32(hdr, VFS301_ARCHIVE_RECORD);
+	put_u32(hdr + 4, length);
+	put_u64(hdr + 8, scan->time_us);
+	put_u32(hdr + 16, scan->reader);
+	put_u32(hdr + 20, scan->flags);
+	put_u32(hdr + 24, scan->width);
+	put_u32(hdr + 28, scan->height);
+	put_u32(hdr + 32, scan->scanlines);
+	put_u32(hdr + 36, scan->received);
+	put_u32(hdr + 40, scan->dropped);
+	put_u32(hdr + 44, scan->resynced);
+	put_u32(hdr + 48, scan->lift_line);
+	put_u32(hdr + 52, scan->gate_result);
+
+	if (fwrite(hdr, sizeof(hdr), 1, w->f) != 1)
+		goto fail;
+	for (i = 0; i < count; i++) {
+		if (lens[i] > 0 && fwrite(parts[i], lens[i], 1, w->f) != 1)
+			goto fail;
+	}
+	if (pad > 0 && fwrite(padding, pad, 1, w->f) != 1)
+		goto fail;
+
+	w->offsets[w->count++] = w->pos;
+	w->pos += length;
+	return 0;
+
+fail:
+	/* the next record goes over what made it to the file */
+	fseek(w->f, w->pos, SEEK_SET);
+	w->errors++;
+	return -1;
+}
+
+int vfs301_archive_flush(vfs301_archive_writer_t *w)
+{
+	return fflush(w->f) == 0 ? 0 : -1;
+}
+
+int vfs301_archive_append_end(vfs301_archive_writer_t *w)
+{
+	unsigned char buf[8];
+	unsigned char trailer[TRAILER_LEN];
+	int errors = w->errors;
+	int i;
+
+	for (i = 0; i < w->count; i++) {
+		put_u64(buf, w->offsets[i]);
+		if (fwrite(buf, sizeof(buf), 1, w->f) != 1)
+			errors++;
+	}
+
+	put_u64(trailer, w->pos);
+	put_u32(trailer + 8, w->count);
+	put_u32(trailer + 12, VFS301_ARCHIVE_INDEX);
+	if (fwrite(trailer, sizeof(trailer), 1, w->f) != 1)
+		errors++;
+
+	/* nothing may follow the index, even after a failed append */
+	if (fflush(w->f) != 0 || ftruncate(fileno(w->f),
+		w->pos + 8LL * w->count + TRAILER_LEN) != 0)
+		errors++;
+
+	if (fclose(w->f) != 0)
+		errors++;
+	free(w->offsets);
+	free(w);
+
+	return errors > 0 ? -1 : 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * vfs301/vfs300 fingerprint reader driver
+ * https://github.com/andree182/vfs301
+ *
+ * Copyright (c) 2011-2012 Andrej Krutak <dev@andree.sk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Archive of scans - a single file growing by one record per scan, with an
+ * index at its end. The file is mapped by the readers; the scans are used
+ * right from the mapping.
+ *
+ * The file starts with VFS301_ARCHIVE_MAGIC (8 bytes), followed by the
+ * records, each starting at a multiple of 8 bytes:
+ *
+ *   u32 magic        - VFS301_ARCHIVE_RECORD
+ *   u32 length       - of the whole record, padded to a multiple of 8
+ *   u64 time         - us since the epoch, when the scan ended
+ *   u32 reader       - number of the reader
+ *   u32 flags        - VFS301_ARCHIVE_*
+ *   u32 width        - px per line
+ *   u32 height       - lines
+ *   u32 scanlines    - frames the image was built from
+ *   u32 received     - frames received
+ *   u32 dropped      - frames missing, by their counters
+ *   u32 resynced     - times the frame stream went out of sync
+ *   i32 lift_line    - frame after which the finger was gone, -1 = none
+ *   u32 gate_result  - VFS301_GATE_*
+ *   data             - width * height bytes - px, or raw frames
+ *
+ * The index follows the last record - its offset (u64) for each record,
+ * and then
+ *
+ *   u64 index        - offset of the index
+ *   u32 count        - number of the records
+ *   u32 magic        - VFS301_ARCHIVE_INDEX
+ *
+ * All the numbers are little endian. More records are appended in place of
+ * the index, and a new one is written after them. When the index is missing
+ * (the writer didn't finish), the records are found by walking them.
+ */
+
+#define VFS301_ARCHIVE_MAGIC "VFS301A1"
+#define VFS301_ARCHIVE_RECORD 0x4e435356 /* "VSCN" */
+#define VFS301_ARCHIVE_INDEX 0x58444956 /* "VIDX" */
+#define VFS301_ARCHIVE_HEADER_LEN 56
+
+/* the lines are whole frames (vfs301_line_t), not just the scans */
+#define VFS301_ARCHIVE_RAW 0x01
+/* the raw frames are stored by their fields (see vfs301_raw_frames_t) -
+ * each of the VFS301_COLUMN_* for all the frames, one after another; the
+ * width is the size of a frame without the sync marks (283 bytes) */
+#define VFS301_ARCHIVE_COLUMNS 0x02
+
+enum {
+	/* u16 frame counters */
+	VFS301_COLUMN_COUNTER = 0,
+	/* vfs301_line_t::flag_1 */
+	VFS301_COLUMN_FLAGS,
+	/* 200 px */
+	VFS301_COLUMN_SCAN,
+	/* 64 bytes */
+	VFS301_COLUMN_MIRROR,
+	/* sum1, sum2 and sum3 - 16 bytes */
+	VFS301_COLUMN_SUMS,
+	VFS301_COLUMNS
+};
+
+/* One scan; data points into the mapped file (when read), or to the image
+ * to be written */
+typedef struct {
+	long long time_us;
+	int reader;
+	int flags;
+	int width;
+	int height;
+	int scanlines;
+	int received;
+	int dropped;
+	int resynced;
+	int lift_line;
+	int gate_result;
+	const unsigned char *data;
+} vfs301_archive_scan_t;
+
+typedef struct vfs301_archive vfs301_archive_t;
+
+/** Maps the archive for reading. Returns NULL if it can't be read. */
+vfs301_archive_t *vfs301_archive_open(const char *fn);
+void vfs301_archive_close(vfs301_archive_t *archive);
+/** Number of the scans */
+int vfs301_archive_count(const vfs301_archive_t *archive);
+/** Fills in the n-th scan, returns -1 if it is damaged */
+int vfs301_archive_scan(
+	const vfs301_archive_t *archive, int n, vfs301_archive_scan_t *scan);
+
+/** Returns the column of a scan stored by the fields - height items of
+ * *size bytes each - or NULL if it isn't such a scan */
+const unsigned char *vfs301_archive_column(
+	const vfs301_archive_scan_t *scan, int column, int *size);
+
+typedef struct vfs301_archive_writer vfs301_archive_writer_t;
+
+/** Opens the archive for appending (creates it if needed). Returns NULL
+ * on error. */
+vfs301_archive_writer_t *vfs301_archive_append_start(const char *fn);
+/** Appends the scan, returns 0 on success */
+int vfs301_archive_append(
+	vfs301_archive_writer_t *writer, const vfs301_archive_scan_t *scan);
+/** The same, with the data (width * height bytes) in count parts, e.g. the
+ * columns; scan->data isn't used */
+int vfs301_archive_append_parts(
+	vfs301_archive_writer_t *writer, const vfs301_archive_scan_t *scan,
+	const unsigned char *const *parts, const size_t *lens, int count);
+/** Writes out the scans appended so far (the index is still missing) */
+int vfs301_archive_flush(vfs301_archive_writer_t *writer);
+/** Writes the index and closes the archive, returns 0 on success */
+int vfs301_archive_append_end(vfs301_archive_writer_t *writer);
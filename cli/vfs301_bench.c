@@ -0,0 +1,1071 @@
+/*
+ * vfs301/vfs300 fingerprint reader driver
+ * https://github.com/andree182/vfs301
+ *
+ * Copyright (c) 2011-2012 Andrej Krutak <dev@andree.sk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Microbenchmark of the image processing kernels.
+ *
+ * Usage: ./vfs301_bench [-p] [-d devices] [-b | -c baseline]
+ *                       [swipe.pgm | archive ...]
+ *
+ * The swipes are PGMs as stored by the cli - either the 200 px wide scans,
+ * or the 288 px wide raw frames (-DOUTPUT_RAW build, cli -D) - or all the
+ * scans of the archives written by "cli -W". Without any, a synthetic swipe
+ * is used.
+ *
+ * -d N scans on 1..N simulated devices at once (vfs301_sim.h, each with
+ * one of the swipes), driven by one event loop as in the cli, to show how
+ * it scales.
+ *
+ * The stages of the scan pipeline (parsing the frames, picking the lines,
+ * the whole scan and copying the image out) are timed each swipe a scan,
+ * as ns per line, MiB/s and the allocations per scan. -b saves them as the
+ * baseline, -c compares them with it and fails if any stage got slower by
+ * more than BENCH_TOLERANCE_PERCENT, allocates more or is missing from it
+ * (as it does if there is no baseline). -p runs only these.
+ *
+ * The allocations are counted by wrapping malloc() and co. at link time
+ * (-Wl,--wrap=malloc,... - see the Makefile).
+ */
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <libusb-1.0/libusb.h>
+
+#include "vfs301_proto.h"
+#include "vfs301_img.h"
+#include "vfs301_transport.h"
+#include "vfs301_sim.h"
+#include "vfs301_archive.h"
+
+#define BENCH_SYNTHETIC_LINES 4000
+#define BENCH_MIN_LINES (1 << 22)
+#define BENCH_DEVICE_LINES (1 << 18)
+#define BENCH_DEVICE_SCANS 10
+#define BENCH_DEFAULT_DEVICES 4
+#define BENCH_PIPELINE_LINES (1 << 18)
+#define BENCH_REPEATS 20
+#define BENCH_TOLERANCE_PERCENT 10
+/* junk before the first frame, as the device sends - it cuts the frames
+ * by the ends of the blocks */
+#define BENCH_JUNK 100
+
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+
+static const char *simd_names[] = {"scalar", "sse2", "avx2"};
+
+typedef struct {
+	unsigned char *lines;
+	int count;
+} swipe_t;
+
+/* the allocations made - all of them, by the driver as well */
+static long allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+	return __real_realloc(ptr, size);
+}
+
+static long long time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long cpu_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/** The line selection as done by the extractor, returns the output height */
+static int select_lines(const swipe_t *swipe)
+{
+	int last_line = 0;
+	int height = 1;
+	int i;
+
+	for (i = 1; i < swipe->count; i++) {
+		if (vfs301_line_sad(
+				swipe->lines + last_line * VFS301_FP_WIDTH,
+				swipe->lines + i * VFS301_FP_WIDTH
+			) / VFS301_FP_WIDTH > VFS301_FP_LINE_DIFF_THRESHOLD
+		) {
+			last_line = i;
+			height++;
+		}
+	}
+
+	return height;
+}
+
+static int check_identical(const swipe_t *swipe, int level)
+{
+	int (*sad)(const unsigned char *, const unsigned char *);
+	int i;
+	int j;
+
+	vfs301_img_simd_select(level);
+	sad = vfs301_line_sad;
+
+	for (i = 0; i < swipe->count; i++) {
+		for (j = i; j < swipe->count && j < i + 8; j++) {
+			const unsigned char *l1 = swipe->lines + i * VFS301_FP_WIDTH;
+			const unsigned char *l2 = swipe->lines + j * VFS301_FP_WIDTH;
+
+			if (sad(l1, l2) != vfs301_line_sad_scalar(l1, l2))
+				return 0;
+			if (vfs301_line_dot(l1, l2) != vfs301_line_dot_scalar(l1, l2))
+				return 0;
+		}
+	}
+
+	/* the sync marks at each position, and cut by the end */
+	for (i = 0; i < VFS301_FP_WIDTH; i++) {
+		unsigned char buf[VFS301_FP_WIDTH + 1] = {0};
+
+		buf[i] = 0x01;
+		buf[i + 1] = 0xfe;
+		for (j = 0; j <= sizeof(buf); j++) {
+			if (vfs301_find_sync(buf, j) != vfs301_find_sync_scalar(buf, j))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+static void bench_selection(const swipe_t *swipes, int count)
+{
+	int level;
+	int max_level = vfs301_img_simd_detect();
+	int rounds;
+	int total_lines = 0;
+	int height;
+	int ref_height = -1;
+	int i;
+	int r;
+	long long t;
+
+	for (i = 0; i < count; i++)
+		total_lines += swipes[i].count;
+	rounds = BENCH_MIN_LINES / total_lines + 1;
+
+	printf("line selection, %d swipes, %d lines, %d rounds\n",
+		count, total_lines, rounds);
+
+	for (level = VFS301_SIMD_SCALAR; level <= max_level; level++) {
+		for (i = 0; i < count; i++) {
+			if (!check_identical(&swipes[i], level)) {
+				printf("  %-8s MISMATCH against scalar!\n", simd_names[level]);
+				exit(1);
+			}
+		}
+
+		vfs301_img_simd_select(level);
+		height = 0;
+
+		t = time_ns();
+		for (r = 0; r < rounds; r++) {
+			for (i = 0; i < count; i++)
+				height += select_lines(&swipes[i]);
+		}
+		t = time_ns() - t;
+
+		if (ref_height < 0)
+			ref_height = height;
+		assert(height == ref_height);
+
+		printf("  %-8s %7.2f ns/line  (%d lines kept)\n",
+			simd_names[level],
+			(double)t / ((double)total_lines * rounds),
+			height / rounds
+		);
+	}
+}
+
+/** Interpolate each line with the next one, as the resampling does */
+static void lerp_lines(const swipe_t *swipe, unsigned char *out)
+{
+	int i;
+
+	for (i = 0; i + 1 < swipe->count; i++) {
+		vfs301_line_lerp(
+			out + i * VFS301_FP_WIDTH,
+			swipe->lines + i * VFS301_FP_WIDTH,
+			swipe->lines + (i + 1) * VFS301_FP_WIDTH,
+			(i * 37) % 257, VFS301_FP_WIDTH);
+	}
+}
+
+static void bench_lerp(const swipe_t *swipes, int count)
+{
+	int level;
+	int max_level = vfs301_img_simd_detect();
+	int rounds;
+	int total_lines = 0;
+	int max_lines = 0;
+	unsigned char *ref;
+	unsigned char *out;
+	int i;
+	int r;
+	long long t;
+
+	for (i = 0; i < count; i++) {
+		total_lines += swipes[i].count;
+		if (swipes[i].count > max_lines)
+			max_lines = swipes[i].count;
+	}
+	rounds = BENCH_MIN_LINES / total_lines + 1;
+
+	ref = malloc(max_lines * VFS301_FP_WIDTH);
+	out = malloc(max_lines * VFS301_FP_WIDTH);
+	assert(ref != NULL && out != NULL);
+
+	printf("line interpolation, %d lines, %d rounds\n", total_lines, rounds);
+
+	for (level = VFS301_SIMD_SCALAR; level <= max_level; level++) {
+		for (i = 0; i < count; i++) {
+			vfs301_img_simd_select(VFS301_SIMD_SCALAR);
+			lerp_lines(&swipes[i], ref);
+			vfs301_img_simd_select(level);
+			lerp_lines(&swipes[i], out);
+
+			if (memcmp(ref, out, (swipes[i].count - 1) * VFS301_FP_WIDTH) != 0) {
+				printf("  %-8s MISMATCH against scalar!\n", simd_names[level]);
+				exit(1);
+			}
+		}
+
+		t = time_ns();
+		for (r = 0; r < rounds; r++) {
+			for (i = 0; i < count; i++)
+				lerp_lines(&swipes[i], out);
+		}
+		t = time_ns() - t;
+
+		printf("  %-8s %7.2f ns/line\n",
+			simd_names[level], (double)t / ((double)total_lines * rounds));
+	}
+
+	free(ref);
+	free(out);
+}
+
+/** A made-up flat-field calibration - column offsets, and gains of 0.5..2 */
+static void bench_calib(short *dark, short *gain)
+{
+	int x;
+
+	for (x = 0; x < VFS301_FP_WIDTH; x++) {
+		dark[x] = 20 + (x * 37) % 11;
+		gain[x] = 512 + (x * 53) % 1537;
+	}
+}
+
+/** Flat-field correct each line */
+static void flat_lines(const swipe_t *swipe, unsigned char *out,
+	const short *dark, const short *gain)
+{
+	int i;
+
+	for (i = 0; i < swipe->count; i++) {
+		vfs301_line_flat(
+			out + i * VFS301_FP_WIDTH, swipe->lines + i * VFS301_FP_WIDTH,
+			dark, gain, 20);
+	}
+}
+
+static void bench_flat(const swipe_t *swipes, int count)
+{
+	short dark[VFS301_FP_WIDTH];
+	short gain[VFS301_FP_WIDTH];
+	int level;
+	int max_level = vfs301_img_simd_detect();
+	int rounds;
+	int total_lines = 0;
+	int max_lines = 0;
+	unsigned char *ref;
+	unsigned char *out;
+	int i;
+	int r;
+	long long t;
+
+	bench_calib(dark, gain);
+
+	for (i = 0; i < count; i++) {
+		total_lines += swipes[i].count;
+		if (swipes[i].count > max_lines)
+			max_lines = swipes[i].count;
+	}
+	rounds = BENCH_MIN_LINES / total_lines + 1;
+
+	ref = malloc(max_lines * VFS301_FP_WIDTH);
+	out = malloc(max_lines * VFS301_FP_WIDTH);
+	assert(ref != NULL && out != NULL);
+
+	printf("flat-field correction, %d lines, %d rounds\n", total_lines, rounds);
+
+	for (level = VFS301_SIMD_SCALAR; level <= max_level; level++) {
+		for (i = 0; i < count; i++) {
+			vfs301_img_simd_select(VFS301_SIMD_SCALAR);
+			flat_lines(&swipes[i], ref, dark, gain);
+			vfs301_img_simd_select(level);
+			flat_lines(&swipes[i], out, dark, gain);
+
+			if (memcmp(ref, out, swipes[i].count * VFS301_FP_WIDTH) != 0) {
+				printf("  %-8s MISMATCH against scalar!\n", simd_names[level]);
+				exit(1);
+			}
+		}
+
+		t = time_ns();
+		for (r = 0; r < rounds; r++) {
+			for (i = 0; i < count; i++)
+				flat_lines(&swipes[i], out, dark, gain);
+		}
+		t = time_ns() - t;
+
+		printf("  %-8s %7.2f ns/line\n",
+			simd_names[level], (double)t / ((double)total_lines * rounds));
+	}
+
+	free(ref);
+	free(out);
+}
+
+/************************** DEVICE SCALING ************************************/
+
+/** Wrap the swipes into raw frames, as they come from the device */
+static unsigned char *frames_from_swipes(const swipe_t *swipes, int count, int *frame_count)
+{
+	vfs301_line_t *frames;
+	int total = 0;
+	int i;
+	int j;
+	int k = 0;
+
+	for (i = 0; i < count; i++)
+		total += swipes[i].count;
+
+	frames = calloc(total, sizeof(*frames));
+	assert(frames != NULL);
+
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < swipes[i].count; j++, k++)
+			vfs301_sim_frame(&frames[k], swipes[i].lines + j * VFS301_FP_WIDTH, k, 1);
+	}
+
+	*frame_count = total;
+	return (unsigned char *)frames;
+}
+
+/** Feed the frames to the device in blocks, as the data endpoint does */
+static void process_frames(vfs301_dev_t *dev, const unsigned char *frames, int frame_count)
+{
+	int lines_per_block = VFS301_FP_RECV_LEN_2 / VFS301_FP_FRAME_SIZE;
+	int i;
+	int n;
+
+	for (i = 0; i < frame_count; i += n) {
+		n = min(lines_per_block, frame_count - i);
+		vfs301_proto_process_data(
+			i == 0, dev, frames + i * VFS301_FP_FRAME_SIZE, n * VFS301_FP_FRAME_SIZE);
+	}
+}
+
+/** The whole image extraction, by each of the ways to build the image */
+static void bench_extraction(const swipe_t *swipes, int count)
+{
+	static const char *mode_names[] = {"select", "mirror", "corr"};
+	vfs301_dev_t *dev;
+	unsigned char *frames;
+	int frame_count;
+	int max_level = vfs301_img_simd_detect();
+	int level;
+	int mode;
+	int rounds;
+	int r;
+	long long t;
+
+	frames = frames_from_swipes(swipes, count, &frame_count);
+	rounds = BENCH_DEVICE_LINES / frame_count + 1;
+	dev = calloc(1, sizeof(*dev));
+	assert(dev != NULL);
+
+	/* calibrated, as after the init */
+	bench_calib(dev->calib_dark, dev->calib_gain);
+	dev->calib_base = 20;
+	dev->calib_lines = 1;
+
+	printf("image extraction (flat-field corrected), %d lines per scan, %d rounds\n",
+		frame_count, rounds);
+
+	for (level = VFS301_SIMD_SCALAR; level <= max_level; level++) {
+		vfs301_img_simd_select(level);
+
+		for (mode = VFS301_RESAMPLE_OFF; mode <= VFS301_RESAMPLE_CORR; mode++) {
+			dev->resample = mode;
+
+			t = time_ns();
+			for (r = 0; r < rounds; r++)
+				process_frames(dev, frames, frame_count);
+			t = time_ns() - t;
+
+			printf("  %-8s %-8s %10.0f lines/s  (%d lines out, speed found in %d)\n",
+				simd_names[level], mode_names[mode],
+				(double)rounds * frame_count / (t / 1e9),
+				dev->img_height, mode ? dev->motion_found : 0);
+		}
+	}
+
+	vfs301_proto_deinit(dev);
+	free(dev);
+	free(frames);
+}
+
+enum {
+	BENCH_INIT,
+	BENCH_REQUEST,
+	BENCH_WAIT,
+	BENCH_SCAN,
+	BENCH_DONE
+};
+
+typedef struct {
+	vfs301_dev_t dev;
+	int step;
+	int scans;
+	int lines;
+} bench_device_t;
+
+/** Advance the device through the init and the scans, as the cli does */
+static void device_step(bench_device_t *bd)
+{
+	vfs301_dev_t *dev = &bd->dev;
+	int rv;
+
+	switch (bd->step) {
+	case BENCH_INIT:
+		rv = vfs301_proto_init_poll(dev);
+		if (rv == VFS301_ONGOING)
+			break;
+		assert(rv == VFS301_ENDED);
+		bd->step = BENCH_REQUEST;
+		break;
+
+	case BENCH_REQUEST:
+		vfs301_proto_request_fingerprint(dev);
+		rv = vfs301_proto_wait_event_start(dev, NULL, NULL);
+		assert(rv >= 0);
+		bd->step = BENCH_WAIT;
+		break;
+
+	case BENCH_WAIT:
+		rv = vfs301_proto_wait_event_poll(dev);
+		if (rv == VFS301_ONGOING)
+			break;
+		assert(rv == VFS301_ENDED);
+		vfs301_proto_process_event_start(dev);
+		bd->step = BENCH_SCAN;
+		break;
+
+	case BENCH_SCAN:
+		rv = vfs301_proto_process_event_poll(dev);
+		if (rv == VFS301_ONGOING)
+			break;
+		assert(rv != VFS301_FAILURE);
+		bd->lines += dev->scanline_count;
+		bd->scans++;
+		bd->step = (bd->scans < BENCH_DEVICE_SCANS) ? BENCH_REQUEST : BENCH_DONE;
+		break;
+	}
+}
+
+/** Step the devices on one event loop, as the cli does, until all of them
+ * are past the step "until" */
+static void devices_run(bench_device_t *bds, int devices, int until)
+{
+	vfs301_transport_t *tr = bds[0].dev.transport;
+	struct timeval tv;
+	int timeout;
+	int running;
+	int i;
+	int r;
+
+	do {
+		running = 0;
+		timeout = VFS301_EVENT_POLL_MAX;
+
+		for (i = 0; i < devices; i++) {
+			if (bds[i].step > until)
+				continue;
+
+			device_step(&bds[i]);
+
+			switch (bds[i].step) {
+			case BENCH_REQUEST:
+				timeout = 0;
+				break;
+			case BENCH_WAIT:
+				timeout = min(timeout, vfs301_proto_wait_event_timeout(&bds[i].dev));
+				break;
+			case BENCH_SCAN:
+				timeout = min(timeout, 2);
+				break;
+			}
+			if (bds[i].step <= until)
+				running++;
+		}
+
+		if (running > 0) {
+			tv.tv_sec = timeout / 1000;
+			tv.tv_usec = (timeout % 1000) * 1000;
+			r = tr->handle_events(tr, &tv);
+			assert(r == 0);
+		}
+	} while (running > 0);
+}
+
+/** Scans on 1..max_devices simulated devices, sharing one event loop. The
+ * devices send as fast as they can, but each scan still waits for the end
+ * of the finish sequence (the data to 0x04 never comes) - the scans/s per
+ * device stay the same as long as the loop keeps up, the CPU load shows
+ * how far it is from not keeping up. */
+static void bench_devices(const swipe_t *swipes, int count, int max_devices)
+{
+	vfs301_sim_params_t params;
+	vfs301_sim_t *sim;
+	bench_device_t *bds;
+	int devices;
+	int lines;
+	int i;
+	int r;
+	long long t;
+	long long cpu;
+	double base = 0;
+	double rate;
+
+	vfs301_sim_params_default(&params);
+	params.line_rate = 0;
+	params.latency_us = 0;
+	params.finger_delay_ms = 0;
+
+	bds = calloc(max_devices, sizeof(*bds));
+	assert(bds != NULL);
+
+	printf("simulated devices on one event loop, %d scans each, 1..%d devices\n",
+		BENCH_DEVICE_SCANS, max_devices);
+
+	for (devices = 1; ; devices = min(devices * 2, max_devices)) {
+		sim = vfs301_sim_new();
+		assert(sim != NULL);
+
+		for (i = 0; i < devices; i++) {
+			memset(&bds[i], 0, sizeof(bds[i]));
+			params.swipe = swipes[i % count].lines;
+			params.swipe_lines = swipes[i % count].count;
+			bds[i].dev.transport = vfs301_sim_device_new(sim, &params);
+			assert(bds[i].dev.transport != NULL);
+			r = vfs301_proto_init_start(&bds[i].dev);
+			assert(r == 0);
+			bds[i].step = BENCH_INIT;
+		}
+
+		/* only the scans are timed */
+		devices_run(bds, devices, BENCH_INIT);
+
+		t = time_ns();
+		cpu = cpu_time_ns();
+		devices_run(bds, devices, BENCH_SCAN);
+		cpu = cpu_time_ns() - cpu;
+		t = time_ns() - t;
+
+		lines = 0;
+		for (i = 0; i < devices; i++) {
+			lines += bds[i].lines;
+			vfs301_proto_deinit(&bds[i].dev);
+			vfs301_transport_free(bds[i].dev.transport);
+		}
+		vfs301_sim_free(sim);
+
+		rate = (double)devices * BENCH_DEVICE_SCANS / (t / 1e9);
+		if (devices == 1)
+			base = rate;
+
+		printf("  %2d devices  %6.1f scans/s  %5.1f per device  %9.0f lines/s  "
+			"%5.1f%% CPU  (%.2fx)\n", devices, rate, rate / devices,
+			lines / (t / 1e9), 100.0 * cpu / t, rate / base);
+
+		if (devices == max_devices)
+			break;
+	}
+
+	free(bds);
+}
+
+typedef struct {
+	vfs301_dev_t *dev;
+	const swipe_t *swipes;
+	int count;
+	/* the frames of each swipe, behind BENCH_JUNK bytes of junk */
+	unsigned char **frames;
+	int *frames_len;
+	unsigned char *output;
+} bench_pipeline_t;
+
+typedef struct {
+	const char *name;
+	/* bytes of the input (or output) per line, for the MiB/s */
+	int line_bytes;
+	/* processes the i-th scan, returns the number of lines */
+	int (*run)(bench_pipeline_t *p, int i);
+	/* the best of the runs, and the allocations per scan over all of them */
+	double ns_line;
+	double allocs;
+	long alloc_count;
+	long scans;
+} bench_stage_t;
+
+/** Feeds the scan to the device in blocks, until it is finished */
+static int feed_scan(vfs301_dev_t *dev, const unsigned char *buf, int len)
+{
+	int i;
+	int n;
+
+	for (i = 0; i < len; i += n) {
+		n = min(VFS301_FP_RECV_LEN_2, len - i);
+		if (!vfs301_proto_process_data(i == 0, dev, buf + i, n))
+			break;
+	}
+
+	return dev->frames_received;
+}
+
+/* Just the parser - with a single scanline kept, the frames are only
+ * checked, counted and watched for the finger */
+static int stage_parse(bench_pipeline_t *p, int i)
+{
+	p->dev->scanline_max = 1;
+	return feed_scan(p->dev, p->frames[i] + BENCH_JUNK, p->frames_len[i] - BENCH_JUNK);
+}
+
+static int stage_parse_cut(bench_pipeline_t *p, int i)
+{
+	p->dev->scanline_max = 1;
+	return feed_scan(p->dev, p->frames[i], p->frames_len[i]);
+}
+
+/* The parser and the line selection of the driver, without the flat-field
+ * correction - the lines picked are just copied out */
+static int stage_select(bench_pipeline_t *p, int i)
+{
+	p->dev->scanline_max = 0;
+	p->dev->flat_field = -1;
+	return feed_scan(p->dev, p->frames[i], p->frames_len[i]);
+}
+
+static int stage_scan(bench_pipeline_t *p, int i)
+{
+	p->dev->scanline_max = 0;
+	p->dev->flat_field = 0;
+	return feed_scan(p->dev, p->frames[i], p->frames_len[i]);
+}
+
+/* The scan with a fresh device, as the first one */
+static int stage_scan_cold(bench_pipeline_t *p, int i)
+{
+	vfs301_proto_deinit(p->dev);
+	return stage_scan(p, i);
+}
+
+/* Copying out the image of the last scan */
+static int stage_output(bench_pipeline_t *p, int i)
+{
+	int height;
+
+	vfs301_extract_image(p->dev, p->output, &height);
+	return height;
+}
+
+static bench_stage_t bench_stages[] = {
+	{"parse", VFS301_FP_FRAME_SIZE, stage_parse},
+	{"parse-cut", VFS301_FP_FRAME_SIZE, stage_parse_cut},
+	{"select", VFS301_FP_FRAME_SIZE, stage_select},
+	{"scan", VFS301_FP_FRAME_SIZE, stage_scan},
+	{"scan-cold", VFS301_FP_FRAME_SIZE, stage_scan_cold},
+	{"output", VFS301_FP_OUTPUT_WIDTH, stage_output},
+};
+
+#define BENCH_STAGES (sizeof(bench_stages) / sizeof(bench_stages[0]))
+
+/** One run of the stage over all the scans, keeps the best time */
+static void bench_stage(bench_pipeline_t *p, bench_stage_t *stage)
+{
+	long long lines = 0;
+	long long t;
+	long start_allocs;
+	int i;
+
+	/* the first scan prepares the device (after the other stages) */
+	stage->run(p, 0);
+
+	start_allocs = allocs;
+	t = time_ns();
+	while (lines < BENCH_PIPELINE_LINES) {
+		for (i = 0; i < p->count; i++, stage->scans++)
+			lines += stage->run(p, i);
+	}
+	t = time_ns() - t;
+
+	stage->alloc_count += allocs - start_allocs;
+	stage->allocs = (double)stage->alloc_count / stage->scans;
+	if (stage->ns_line < 0 || (double)t / lines < stage->ns_line)
+		stage->ns_line = (double)t / lines;
+}
+
+/** Reads the results saved by bench_save() into the stages, returns the
+ * number of lines they were taken over, or -1 */
+static int bench_load(const char *fn, bench_stage_t *stages)
+{
+	FILE *f;
+	char name[64];
+	double ns_line;
+	double allocs;
+	int lines = -1;
+	int i;
+
+	f = fopen(fn, "r");
+	if (f == NULL)
+		return -1;
+
+	if (fscanf(f, "# vfs301_bench baseline, %d lines\n", &lines) != 1)
+		lines = 0;
+	while (fscanf(f, "%63s %lf %lf\n", name, &ns_line, &allocs) == 3) {
+		for (i = 0; i < BENCH_STAGES; i++) {
+			if (strcmp(name, stages[i].name) == 0) {
+				stages[i].ns_line = ns_line;
+				stages[i].allocs = allocs;
+			}
+		}
+	}
+
+	fclose(f);
+	return lines;
+}
+
+static int bench_save(const char *fn, int lines)
+{
+	FILE *f;
+	int i;
+
+	f = fopen(fn, "w");
+	if (f == NULL) {
+		perror(fn);
+		return -1;
+	}
+
+	fprintf(f, "# vfs301_bench baseline, %d lines\n", lines);
+	for (i = 0; i < BENCH_STAGES; i++) {
+		fprintf(f, "%s %.3f %.2f\n",
+			bench_stages[i].name, bench_stages[i].ns_line, bench_stages[i].allocs);
+	}
+
+	if (fclose(f) != 0) {
+		perror(fn);
+		return -1;
+	}
+	return 0;
+}
+
+/** The stages of the scan pipeline, each swipe a scan; compared with the
+ * baseline if there is one. Returns the number of stages that got worse
+ * (or are missing from the baseline), non-zero as well if the baseline
+ * can't be read or saved. */
+static int bench_pipeline(const swipe_t *swipes, int count,
+	const char *save_fn, const char *check_fn)
+{
+	bench_pipeline_t p;
+	bench_stage_t base[BENCH_STAGES];
+	bench_stage_t *stage;
+	int base_lines = -1;
+	int lines = 0;
+	int worse = 0;
+	int regress;
+	int max_height = 0;
+	int repeat;
+	int i;
+
+	memset(&p, 0, sizeof(p));
+	p.swipes = swipes;
+	p.count = count;
+	p.frames = calloc(count, sizeof(*p.frames));
+	p.frames_len = calloc(count, sizeof(*p.frames_len));
+	p.dev = calloc(1, sizeof(*p.dev));
+	assert(p.frames != NULL && p.frames_len != NULL && p.dev != NULL);
+
+	for (i = 0; i < count; i++) {
+		unsigned char *frames;
+		int frame_count;
+
+		frames = frames_from_swipes(&swipes[i], 1, &frame_count);
+		p.frames_len[i] = BENCH_JUNK + frame_count * VFS301_FP_FRAME_SIZE;
+		p.frames[i] = calloc(1, p.frames_len[i]);
+		assert(p.frames[i] != NULL);
+		memcpy(p.frames[i] + BENCH_JUNK, frames, frame_count * VFS301_FP_FRAME_SIZE);
+		free(frames);
+
+		lines += swipes[i].count;
+		max_height = max(max_height, swipes[i].count);
+	}
+
+	p.output = malloc(VFS301_DEFAULT_MAX_SCANLINES * VFS301_FP_OUTPUT_WIDTH);
+	assert(p.output != NULL);
+
+	/* calibrated, as after the init */
+	bench_calib(p.dev->calib_dark, p.dev->calib_gain);
+	p.dev->calib_base = 20;
+	p.dev->calib_lines = 1;
+
+	if (check_fn != NULL) {
+		memcpy(base, bench_stages, sizeof(base));
+		for (i = 0; i < BENCH_STAGES; i++)
+			base[i].ns_line = -1;
+		base_lines = bench_load(check_fn, base);
+		if (base_lines < 0) {
+			perror(check_fn);
+			worse++;
+		} else if (base_lines != lines)
+			printf("(the baseline was taken over %d lines, not %d)\n", base_lines, lines);
+	}
+
+	printf("scan pipeline stages, %d scans, %d lines (up to %d a scan)\n",
+		count, lines, max_height);
+
+	/* the stages take turns, so that a slow while hits all of them */
+	for (i = 0; i < BENCH_STAGES; i++)
+		bench_stages[i].ns_line = -1;
+	for (repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+		for (i = 0; i < BENCH_STAGES; i++)
+			bench_stage(&p, &bench_stages[i]);
+	}
+
+	for (i = 0; i < BENCH_STAGES; i++) {
+		stage = &bench_stages[i];
+
+		printf("  %-10s %8.2f ns/line %9.1f MiB/s %6.2f allocs/scan",
+			stage->name, stage->ns_line,
+			stage->line_bytes / stage->ns_line * 1e9 / (1 << 20), stage->allocs);
+
+		if (base_lines >= 0 && base[i].ns_line <= 0) {
+			printf("  not in the baseline");
+			worse++;
+		} else if (base_lines >= 0) {
+			regress = stage->ns_line >
+					base[i].ns_line * (100 + BENCH_TOLERANCE_PERCENT) / 100 ||
+				stage->allocs > base[i].allocs + 0.005;
+			printf("  %+6.1f%%%s", (stage->ns_line / base[i].ns_line - 1) * 100,
+				regress ? "  REGRESSION" : "");
+			worse += regress;
+		}
+		printf("\n");
+	}
+
+	if (base_lines >= 0)
+		printf("  %d of %zu stages worse than the baseline %s, or not in it\n",
+			worse, BENCH_STAGES, check_fn);
+
+	if (save_fn != NULL) {
+		if (bench_save(save_fn, lines) == 0)
+			printf("  saved as the baseline %s\n", save_fn);
+		else
+			worse++;
+	}
+
+	vfs301_proto_deinit(p.dev);
+	for (i = 0; i < count; i++)
+		free(p.frames[i]);
+	free(p.frames);
+	free(p.frames_len);
+	free(p.output);
+	free(p.dev);
+
+	return worse;
+}
+
+/** Appends the swipe to the list, which grows as needed */
+static void add_swipe(swipe_t **swipes, int *count, int *capacity,
+	unsigned char *lines, int lines_count)
+{
+	if (*count == *capacity) {
+		*capacity *= 2;
+		*swipes = realloc(*swipes, *capacity * sizeof(**swipes));
+		assert(*swipes != NULL);
+	}
+	(*swipes)[*count].lines = lines;
+	(*swipes)[*count].count = lines_count;
+	(*count)++;
+}
+
+/** Adds the scans of the archive as swipes, returns -1 if it is none */
+static int load_archive(const char *fn, swipe_t **swipes, int *count, int *capacity)
+{
+	vfs301_archive_t *archive;
+	vfs301_archive_scan_t scan;
+	unsigned char *lines;
+	const unsigned char *column;
+	int offset;
+	int size;
+	int i;
+	int j;
+
+	archive = vfs301_archive_open(fn);
+	if (archive == NULL)
+		return -1;
+
+	for (i = 0; i < vfs301_archive_count(archive); i++) {
+		if (vfs301_archive_scan(archive, i, &scan) < 0 || scan.height < 2)
+			continue;
+
+		/* the raw frames stored by their fields - the scans are together */
+		column = vfs301_archive_column(&scan, VFS301_COLUMN_SCAN, &size);
+		if (column != NULL) {
+			scan.data = column;
+			scan.width = size;
+		}
+
+		if (scan.width == VFS301_FP_WIDTH)
+			offset = 0;
+		else if (scan.width == VFS301_FP_FRAME_SIZE)
+			offset = offsetof(vfs301_line_t, scan);
+		else
+			continue;
+
+		lines = malloc(scan.height * VFS301_FP_WIDTH);
+		assert(lines != NULL);
+		for (j = 0; j < scan.height; j++)
+			memcpy(lines + j * VFS301_FP_WIDTH,
+				scan.data + j * scan.width + offset, VFS301_FP_WIDTH);
+		add_swipe(swipes, count, capacity, lines, scan.height);
+	}
+
+	vfs301_archive_close(archive);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	swipe_t *swipes;
+	unsigned char *lines;
+	int lines_count;
+	int count = 0;
+	int capacity;
+	int max_devices = BENCH_DEFAULT_DEVICES;
+	int pipeline_only = 0;
+	const char *save_fn = NULL;
+	const char *check_fn = NULL;
+	int worse;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "d:pb:c:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			max_devices = atoi(optarg);
+			break;
+		case 'p':
+			pipeline_only = 1;
+			break;
+		case 'b':
+			save_fn = optarg;
+			break;
+		case 'c':
+			check_fn = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-p] [-d devices] [-b | -c baseline] "
+				"[swipe.pgm | archive ...]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	capacity = argc > optind ? argc - optind : 1;
+	swipes = calloc(capacity, sizeof(*swipes));
+	assert(swipes != NULL);
+
+	for (i = optind; i < argc; i++) {
+		if (load_archive(argv[i], &swipes, &count, &capacity) == 0)
+			continue;
+
+		lines = vfs301_sim_swipe_load(argv[i], &lines_count);
+		if (lines != NULL && lines_count > 1)
+			add_swipe(&swipes, &count, &capacity, lines, lines_count);
+		else
+			free(lines);
+	}
+
+	if (count == 0) {
+		swipes[0].count = BENCH_SYNTHETIC_LINES;
+		swipes[0].lines = vfs301_sim_swipe_synthetic(swipes[0].count, 301);
+		count = 1;
+	}
+
+	if (!pipeline_only) {
+		bench_selection(swipes, count);
+		bench_lerp(swipes, count);
+		bench_flat(swipes, count);
+		bench_extraction(swipes, count);
+		if (max_devices > 0)
+			bench_devices(swipes, count, max_devices);
+	}
+	worse = bench_pipeline(swipes, count, save_fn, check_fn);
+
+	for (i = 0; i < count; i++)
+		free(swipes[i].lines);
+	free(swipes);
+
+	return worse > 0;
+}
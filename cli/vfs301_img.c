@@ -0,0 +1,473 @@
+/*
+ * vfs301/vfs300 fingerprint reader driver
+ * https://github.com/andree182/vfs301
+ *
+ * Copyright (c) 2011-2012 Andrej Krutak <dev@andree.sk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <libusb-1.0/libusb.h>
+
+#include "vfs301_proto.h"
+#include "vfs301_img.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VFS301_X86
+#endif
+
+/************************** LINE DIFFERENCE ***********************************/
+
+int vfs301_line_sad_scalar(const unsigned char *line1, const unsigned char *line2)
+{
+	int i;
+	int diff;
+
+	for (diff = 0, i = 0; i < VFS301_FP_WIDTH; i++) {
+		if (*line1 > *line2)
+			diff += *line1 - *line2;
+		else
+			diff += *line2 - *line1;
+
+		line1++;
+		line2++;
+	}
+
+	return diff;
+}
+
+#ifdef VFS301_X86
+
+/* The kernels below expect 200 px = 12 * 16 B + 8 B */
+typedef char vfs301_sad_width_check[(VFS301_FP_WIDTH % 16 == 8) ? 1 : -1];
+
+__attribute__((target("sse2")))
+int vfs301_line_sad_sse2(const unsigned char *line1, const unsigned char *line2)
+{
+	__m128i acc = _mm_setzero_si128();
+	int i;
+
+	for (i = 0; i + 16 <= VFS301_FP_WIDTH; i += 16) {
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(
+			_mm_loadu_si128((const __m128i *)(line1 + i)),
+			_mm_loadu_si128((const __m128i *)(line2 + i))
+		));
+	}
+
+	acc = _mm_add_epi64(acc, _mm_sad_epu8(
+		_mm_loadl_epi64((const __m128i *)(line1 + i)),
+		_mm_loadl_epi64((const __m128i *)(line2 + i))
+	));
+
+	return _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+}
+
+__attribute__((target("avx2")))
+int vfs301_line_sad_avx2(const unsigned char *line1, const unsigned char *line2)
+{
+	__m256i acc = _mm256_setzero_si256();
+	__m128i acc128;
+	int i;
+
+	for (i = 0; i + 32 <= VFS301_FP_WIDTH; i += 32) {
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(
+			_mm256_loadu_si256((const __m256i *)(line1 + i)),
+			_mm256_loadu_si256((const __m256i *)(line2 + i))
+		));
+	}
+
+	acc128 = _mm_add_epi64(
+		_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+
+	/* 200 px = 6 * 32 B + 8 B */
+	acc128 = _mm_add_epi64(acc128, _mm_sad_epu8(
+		_mm_loadl_epi64((const __m128i *)(line1 + i)),
+		_mm_loadl_epi64((const __m128i *)(line2 + i))
+	));
+
+	return _mm_cvtsi128_si32(acc128) + _mm_cvtsi128_si32(_mm_srli_si128(acc128, 8));
+}
+
+#endif /* VFS301_X86 */
+
+/************************** LINE INTERPOLATION ********************************/
+
+void vfs301_line_lerp_scalar(
+	unsigned char *out, const unsigned char *line1, const unsigned char *line2,
+	int weight, int width)
+{
+	int i;
+
+	for (i = 0; i < width; i++)
+		out[i] = (line1[i] * (256 - weight) + line2[i] * weight + 128) >> 8;
+}
+
+#ifdef VFS301_X86
+
+/* Both of the kernels below work on 16 bit lanes - the weighted sum stays
+ * within 255 * 256 + 128, so it doesn't overflow. */
+
+__attribute__((target("sse2")))
+void vfs301_line_lerp_sse2(
+	unsigned char *out, const unsigned char *line1, const unsigned char *line2,
+	int weight, int width)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi16(128);
+	const __m128i w1 = _mm_set1_epi16(256 - weight);
+	const __m128i w2 = _mm_set1_epi16(weight);
+	__m128i a;
+	__m128i b;
+	__m128i lo;
+	__m128i hi;
+	int i;
+
+	for (i = 0; i + 16 <= width; i += 16) {
+		a = _mm_loadu_si128((const __m128i *)(line1 + i));
+		b = _mm_loadu_si128((const __m128i *)(line2 + i));
+
+		lo = _mm_add_epi16(
+			_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), w1),
+			_mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), w2));
+		hi = _mm_add_epi16(
+			_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), w1),
+			_mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), w2));
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 8);
+
+		_mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(lo, hi));
+	}
+
+	vfs301_line_lerp_scalar(out + i, line1 + i, line2 + i, weight, width - i);
+}
+
+__attribute__((target("avx2")))
+void vfs301_line_lerp_avx2(
+	unsigned char *out, const unsigned char *line1, const unsigned char *line2,
+	int weight, int width)
+{
+	const __m256i round = _mm256_set1_epi16(128);
+	const __m256i w1 = _mm256_set1_epi16(256 - weight);
+	const __m256i w2 = _mm256_set1_epi16(weight);
+	__m256i a;
+	__m256i b;
+	__m256i r;
+	int i;
+
+	for (i = 0; i + 16 <= width; i += 16) {
+		a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(line1 + i)));
+		b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(line2 + i)));
+
+		r = _mm256_add_epi16(_mm256_mullo_epi16(a, w1), _mm256_mullo_epi16(b, w2));
+		r = _mm256_srli_epi16(_mm256_add_epi16(r, round), 8);
+
+		/* the pack works per 128 bit lane, gather its low halves */
+		r = _mm256_permute4x64_epi64(_mm256_packus_epi16(r, r), 0x08);
+		_mm_storeu_si128((__m128i *)(out + i), _mm256_castsi256_si128(r));
+	}
+
+	vfs301_line_lerp_scalar(out + i, line1 + i, line2 + i, weight, width - i);
+}
+
+#endif /* VFS301_X86 */
+
+/************************** LINE CORRELATION **********************************/
+
+int vfs301_line_dot_scalar(const unsigned char *line1, const unsigned char *line2)
+{
+	int i;
+	int dot = 0;
+
+	for (i = 0; i < VFS301_FP_WIDTH; i++)
+		dot += line1[i] * line2[i];
+
+	return dot;
+}
+
+#ifdef VFS301_X86
+
+/* The products are summed in 32 bit lanes, 200 * 255 * 255 fits easily */
+
+__attribute__((target("sse2")))
+int vfs301_line_dot_sse2(const unsigned char *line1, const unsigned char *line2)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc = _mm_setzero_si128();
+	__m128i a;
+	__m128i b;
+	int i;
+
+	for (i = 0; i + 16 <= VFS301_FP_WIDTH; i += 16) {
+		a = _mm_loadu_si128((const __m128i *)(line1 + i));
+		b = _mm_loadu_si128((const __m128i *)(line2 + i));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(
+			_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(
+			_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)));
+	}
+
+	/* 200 px = 12 * 16 B + 8 B */
+	a = _mm_loadl_epi64((const __m128i *)(line1 + i));
+	b = _mm_loadl_epi64((const __m128i *)(line2 + i));
+	acc = _mm_add_epi32(acc, _mm_madd_epi16(
+		_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)));
+
+	acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 8));
+	acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 4));
+	return _mm_cvtsi128_si32(acc);
+}
+
+__attribute__((target("avx2")))
+int vfs301_line_dot_avx2(const unsigned char *line1, const unsigned char *line2)
+{
+	__m256i acc = _mm256_setzero_si256();
+	__m128i acc128;
+	int i;
+
+	for (i = 0; i + 16 <= VFS301_FP_WIDTH; i += 16) {
+		acc = _mm256_add_epi32(acc, _mm256_madd_epi16(
+			_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(line1 + i))),
+			_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(line2 + i)))
+		));
+	}
+
+	acc128 = _mm_add_epi32(
+		_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+
+	/* 200 px = 12 * 16 B + 8 B */
+	acc128 = _mm_add_epi32(acc128, _mm_madd_epi16(
+		_mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(line1 + i))),
+		_mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(line2 + i)))
+	));
+
+	acc128 = _mm_add_epi32(acc128, _mm_srli_si128(acc128, 8));
+	acc128 = _mm_add_epi32(acc128, _mm_srli_si128(acc128, 4));
+	return _mm_cvtsi128_si32(acc128);
+}
+
+#endif /* VFS301_X86 */
+
+/************************** FLAT FIELD ****************************************/
+
+void vfs301_line_flat_scalar(
+	unsigned char *out, const unsigned char *line,
+	const short *dark, const short *gain, int base)
+{
+	int i;
+	int v;
+
+	/* the same steps as the 16 bit lanes below (the products are < 2^31,
+	 * the shift rounds down the same way) */
+	for (i = 0; i < VFS301_FP_WIDTH; i++) {
+		v = (((line[i] - dark[i]) * 64 * gain[i]) >> 16) + base;
+		out[i] = v < 0 ? 0 : (v > 255 ? 255 : v);
+	}
+}
+
+#ifdef VFS301_X86
+
+/* (line - dark) * 64 stays within 16 bits, the high half of its product
+ * with the Q10 gain is then (line - dark) * gain / 1024 */
+
+__attribute__((target("sse2")))
+void vfs301_line_flat_sse2(
+	unsigned char *out, const unsigned char *line,
+	const short *dark, const short *gain, int base)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i base16 = _mm_set1_epi16(base);
+	__m128i v;
+	int i;
+
+	/* 200 px = 25 * 8 px */
+	for (i = 0; i < VFS301_FP_WIDTH; i += 8) {
+		v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(line + i)), zero);
+		v = _mm_slli_epi16(_mm_sub_epi16(v, _mm_loadu_si128((const __m128i *)(dark + i))), 6);
+		v = _mm_mulhi_epi16(v, _mm_loadu_si128((const __m128i *)(gain + i)));
+		v = _mm_add_epi16(v, base16);
+		_mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(v, v));
+	}
+}
+
+__attribute__((target("avx2")))
+void vfs301_line_flat_avx2(
+	unsigned char *out, const unsigned char *line,
+	const short *dark, const short *gain, int base)
+{
+	const __m256i base16 = _mm256_set1_epi16(base);
+	__m256i v;
+	__m128i v128;
+	int i;
+
+	for (i = 0; i + 16 <= VFS301_FP_WIDTH; i += 16) {
+		v = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(line + i)));
+		v = _mm256_slli_epi16(
+			_mm256_sub_epi16(v, _mm256_loadu_si256((const __m256i *)(dark + i))), 6);
+		v = _mm256_mulhi_epi16(v, _mm256_loadu_si256((const __m256i *)(gain + i)));
+		v = _mm256_add_epi16(v, base16);
+		/* the pack works per 128 bit lane, gather its low halves */
+		v = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), 0x08);
+		_mm_storeu_si128((__m128i *)(out + i), _mm256_castsi256_si128(v));
+	}
+
+	/* 200 px = 12 * 16 px + 8 px */
+	v128 = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(line + i)));
+	v128 = _mm_slli_epi16(_mm_sub_epi16(v128, _mm_loadu_si128((const __m128i *)(dark + i))), 6);
+	v128 = _mm_mulhi_epi16(v128, _mm_loadu_si128((const __m128i *)(gain + i)));
+	v128 = _mm_add_epi16(v128, _mm256_castsi256_si128(base16));
+	_mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(v128, v128));
+}
+
+#endif /* VFS301_X86 */
+
+/************************** FRAME SYNC ****************************************/
+
+int vfs301_find_sync_scalar(const unsigned char *buf, int len)
+{
+	int i;
+
+	for (i = 0; i + 1 < len; i++) {
+		if (buf[i] == 0x01 && buf[i + 1] == 0xfe)
+			return i;
+	}
+
+	/* the 0xfe may be in the next block */
+	if (len > 0 && buf[len - 1] == 0x01)
+		return len - 1;
+
+	return len;
+}
+
+#ifdef VFS301_X86
+
+/* Both of the kernels compare 16 / 32 positions at once - the bytes there
+ * with 0x01, and the bytes right behind them with 0xfe */
+
+__attribute__((target("sse2")))
+int vfs301_find_sync_sse2(const unsigned char *buf, int len)
+{
+	const __m128i sync_01 = _mm_set1_epi8(0x01);
+	const __m128i sync_fe = _mm_set1_epi8((char)0xfe);
+	int mask;
+	int i;
+
+	for (i = 0; i + 17 <= len; i += 16) {
+		mask = _mm_movemask_epi8(_mm_and_si128(
+			_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i)), sync_01),
+			_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 1)), sync_fe)
+		));
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + vfs301_find_sync_scalar(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+int vfs301_find_sync_avx2(const unsigned char *buf, int len)
+{
+	const __m256i sync_01 = _mm256_set1_epi8(0x01);
+	const __m256i sync_fe = _mm256_set1_epi8((char)0xfe);
+	unsigned int mask;
+	int i;
+
+	for (i = 0; i + 33 <= len; i += 32) {
+		mask = _mm256_movemask_epi8(_mm256_and_si256(
+			_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i)), sync_01),
+			_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i + 1)), sync_fe)
+		));
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + vfs301_find_sync_scalar(buf + i, len - i);
+}
+
+#endif /* VFS301_X86 */
+
+/************************** RUNTIME DISPATCH **********************************/
+
+/* Scalar until simd_init() picks the best ones, before main() - no thread
+ * can see them change */
+int (*vfs301_line_sad)(const unsigned char *line1, const unsigned char *line2) =
+	vfs301_line_sad_scalar;
+void (*vfs301_line_lerp)(
+	unsigned char *out, const unsigned char *line1, const unsigned char *line2,
+	int weight, int width) = vfs301_line_lerp_scalar;
+int (*vfs301_line_dot)(const unsigned char *line1, const unsigned char *line2) =
+	vfs301_line_dot_scalar;
+int (*vfs301_find_sync)(const unsigned char *buf, int len) = vfs301_find_sync_scalar;
+void (*vfs301_line_flat)(
+	unsigned char *out, const unsigned char *line,
+	const short *dark, const short *gain, int base) = vfs301_line_flat_scalar;
+
+int vfs301_img_simd_detect(void)
+{
+#ifdef VFS301_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return VFS301_SIMD_AVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return VFS301_SIMD_SSE2;
+#endif
+	return VFS301_SIMD_SCALAR;
+}
+
+int vfs301_img_simd_select(int level)
+{
+	int supported = vfs301_img_simd_detect();
+
+	if (level > supported)
+		level = supported;
+
+	switch (level) {
+#ifdef VFS301_X86
+	case VFS301_SIMD_AVX2:
+		vfs301_line_sad = vfs301_line_sad_avx2;
+		vfs301_line_lerp = vfs301_line_lerp_avx2;
+		vfs301_line_dot = vfs301_line_dot_avx2;
+		vfs301_find_sync = vfs301_find_sync_avx2;
+		vfs301_line_flat = vfs301_line_flat_avx2;
+		break;
+	case VFS301_SIMD_SSE2:
+		vfs301_line_sad = vfs301_line_sad_sse2;
+		vfs301_line_lerp = vfs301_line_lerp_sse2;
+		vfs301_line_dot = vfs301_line_dot_sse2;
+		vfs301_find_sync = vfs301_find_sync_sse2;
+		vfs301_line_flat = vfs301_line_flat_sse2;
+		break;
+#endif
+	default:
+		level = VFS301_SIMD_SCALAR;
+		vfs301_line_sad = vfs301_line_sad_scalar;
+		vfs301_line_lerp = vfs301_line_lerp_scalar;
+		vfs301_line_dot = vfs301_line_dot_scalar;
+		vfs301_find_sync = vfs301_find_sync_scalar;
+		vfs301_line_flat = vfs301_line_flat_scalar;
+		break;
+	}
+
+	return level;
+}
+
+__attribute__((constructor))
+static void simd_init(void)
+{
+	vfs301_img_simd_select(vfs301_img_simd_detect());
+}
@@ -0,0 +1,99 @@
+/*
+ * vfs301/vfs300 fingerprint reader driver
+ * https://github.com/andree182/vfs301
+ *
+ * Copyright (c) 2011-2012 Andrej Krutak <dev@andree.sk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Image processing kernels used by the scan pipeline */
+
+enum {
+	VFS301_SIMD_SCALAR = 0,
+	VFS301_SIMD_SSE2,
+	VFS301_SIMD_AVX2
+};
+
+/** Returns the best kernel variant supported by the running CPU */
+int vfs301_img_simd_detect(void);
+/** Force the kernel variant (e.g. for benchmarking), returns the one set.
+ * The best one is set when the program is loaded; this must not be called
+ * while other threads may be using the kernels. */
+int vfs301_img_simd_select(int level);
+
+/** Sum of absolute differences of two VFS301_FP_WIDTH px lines */
+extern int (*vfs301_line_sad)(const unsigned char *line1, const unsigned char *line2);
+
+int vfs301_line_sad_scalar(const unsigned char *line1, const unsigned char *line2);
+#if defined(__x86_64__) || defined(__i386__)
+int vfs301_line_sad_sse2(const unsigned char *line1, const unsigned char *line2);
+int vfs301_line_sad_avx2(const unsigned char *line1, const unsigned char *line2);
+#endif
+
+/** Linear interpolation of two lines of the given width:
+ * out = (line1 * (256 - weight) + line2 * weight) / 256, weight 0..256 */
+extern void (*vfs301_line_lerp)(
+	unsigned char *out, const unsigned char *line1, const unsigned char *line2,
+	int weight, int width);
+
+void vfs301_line_lerp_scalar(
+	unsigned char *out, const unsigned char *line1, const unsigned char *line2,
+	int weight, int width);
+#if defined(__x86_64__) || defined(__i386__)
+void vfs301_line_lerp_sse2(
+	unsigned char *out, const unsigned char *line1, const unsigned char *line2,
+	int weight, int width);
+void vfs301_line_lerp_avx2(
+	unsigned char *out, const unsigned char *line1, const unsigned char *line2,
+	int weight, int width);
+#endif
+
+/** Dot product of two VFS301_FP_WIDTH px lines */
+extern int (*vfs301_line_dot)(const unsigned char *line1, const unsigned char *line2);
+
+int vfs301_line_dot_scalar(const unsigned char *line1, const unsigned char *line2);
+#if defined(__x86_64__) || defined(__i386__)
+int vfs301_line_dot_sse2(const unsigned char *line1, const unsigned char *line2);
+int vfs301_line_dot_avx2(const unsigned char *line1, const unsigned char *line2);
+#endif
+
+/** Flat-field correction of a VFS301_FP_WIDTH px line (out may be line):
+ * out = (line - dark) * gain / 1024 + base, gain in 0..4096 */
+extern void (*vfs301_line_flat)(
+	unsigned char *out, const unsigned char *line,
+	const short *dark, const short *gain, int base);
+
+void vfs301_line_flat_scalar(
+	unsigned char *out, const unsigned char *line,
+	const short *dark, const short *gain, int base);
+#if defined(__x86_64__) || defined(__i386__)
+void vfs301_line_flat_sse2(
+	unsigned char *out, const unsigned char *line,
+	const short *dark, const short *gain, int base);
+void vfs301_line_flat_avx2(
+	unsigned char *out, const unsigned char *line,
+	const short *dark, const short *gain, int base);
+#endif
+
+/** Offset of the first frame sync marks (01 FE) in buf - or of a 01 ending
+ * it, the FE may be in the next block. Returns len if there are none. */
+extern int (*vfs301_find_sync)(const unsigned char *buf, int len);
+
+int vfs301_find_sync_scalar(const unsigned char *buf, int len);
+#if defined(__x86_64__) || defined(__i386__)
+int vfs301_find_sync_sse2(const unsigned char *buf, int len);
+int vfs301_find_sync_avx2(const unsigned char *buf, int len);
+#endif
@@ -28,21 +28,36 @@
  *   - describe some interesting structures better
  */
 #include <errno.h>
+#include <stddef.h>
 #include <signal.h>
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <time.h>
+#include <math.h>
 #include <libusb-1.0/libusb.h>
 
 #include "vfs301_proto.h"
+#include "vfs301_img.h"
+#include "vfs301_transport.h"
 #include "vfs301_proto_fragments.h"
+#include "vfs301_proto_messages.h"
 #include <unistd.h>
 
 #define min(a, b) (((a) < (b)) ? (a) : (b))
+#define max(a, b) (((a) > (b)) ? (a) : (b))
 
 /************************** USB STUFF *****************************************/
 
+static long long vfs301_time_us(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
 #ifdef DEBUG
 static void usb_print_packet(int dir, int rv, const unsigned char *data, int length) 
 {
@@ -64,105 +79,86 @@ static void usb_print_packet(int dir, int rv, const unsigned char *data, int len
 }
 #endif
 
-static int usb_recv(
-	vfs301_dev_t *dev,
-	struct libusb_device_handle *devh, unsigned char endpoint, int max_bytes)
+/* The transport calls - libusb on dev->devh, unless another one is set */
+static int usb_submit_transfer(vfs301_dev_t *dev, struct libusb_transfer *transfer)
 {
-	assert(max_bytes <= sizeof(dev->recv_buf));
-	
-	int r = libusb_bulk_transfer(
-		devh, endpoint, 
-		dev->recv_buf, max_bytes,
-		&dev->recv_len, VFS301_DEFAULT_WAIT_TIMEOUT
-	);
-	
-#ifdef DEBUG
-	usb_print_packet(0, r, dev->recv_buf, dev->recv_len);
-#endif
+	if (dev->transport != NULL)
+		return dev->transport->submit_transfer(dev->transport, transfer);
 	
-	if (r < 0)
-		return r;
-	return 0;
+	return libusb_submit_transfer(transfer);
 }
 
-static int usb_send(
-	struct libusb_device_handle *devh, const unsigned char *data, int length)
+static int usb_cancel_transfer(vfs301_dev_t *dev, struct libusb_transfer *transfer)
 {
-	int transferred = 0;
+	if (dev->transport != NULL)
+		return dev->transport->cancel_transfer(dev->transport, transfer);
 	
-	int r = libusb_bulk_transfer(
-		devh, VFS301_SEND_ENDPOINT, 
-		(unsigned char *)data, length, &transferred, VFS301_DEFAULT_WAIT_TIMEOUT
-	);
+	return libusb_cancel_transfer(transfer);
+}
 
-#ifdef DEBUG
-	usb_print_packet(1, r, data, length);
-#endif
-	
-	assert(r == 0);
-	
-	if (r < 0)
-		return r;
-	if (transferred < length)
-		return r;
+/* NULL if the device can't DMA into the memory of the process */
+static unsigned char *usb_dev_mem_alloc(vfs301_dev_t *dev, size_t length)
+{
+	if (dev->transport != NULL) {
+		if (dev->transport->dev_mem_alloc == NULL)
+			return NULL;
+		return dev->transport->dev_mem_alloc(dev->transport, length);
+	}
 	
-	return 0;
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+	if (dev->devh != NULL)
+		return libusb_dev_mem_alloc(dev->devh, length);
+#endif
+	return NULL;
 }
 
-/************************** OUT MESSAGES GENERATION ***************************/
-
-static void vfs301_proto_generate_0B(int subtype, unsigned char *data, int *len)
+static void usb_dev_mem_free(vfs301_dev_t *dev, unsigned char *buf, size_t length)
 {
-	*data = 0x0B;
-	*len = 1;
-	data++;
-	
-	memset(data, 0, 39);
-	*len += 38;
-	
-	data[20] = subtype;
-	
-	switch (subtype) {
-	case 0x04:
-		data[34] = 0x9F;
-		break;
-	case 0x05:
-		data[34] = 0xAB;
-		len++;
-		break;
-	default:
-		assert(!"unsupported");
-		break;
+	if (dev->transport != NULL) {
+		dev->transport->dev_mem_free(dev->transport, buf, length);
+		return;
 	}
+	
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+	libusb_dev_mem_free(dev->devh, buf, length);
+#endif
 }
 
-#define HEX_TO_INT(c) \
-	(((c) >= '0' && (c) <= '9') ? ((c) - '0') : ((c) - 'A' + 10))
-	
-static void translate_str(const char **srcL, unsigned char *data, int *len)
+static int usb_handle_events(vfs301_dev_t *dev, int timeout_ms)
 {
-	const char *src;
-	unsigned char *dataOrig = data;
+	struct timeval tv;
 	
-	while (*srcL != NULL) {
-		src = *srcL;
-		while (*src != '\0') {
-			assert(*src != '\0');
-			assert(*(src +1) != '\0');
-			*data = 
-				(unsigned char)((HEX_TO_INT(*src) << 4) | (HEX_TO_INT(*(src + 1))));
-
-			data++;
-			src += 2;
-		}
-		
-		srcL++;
-	}
+	tv.tv_sec = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000;
+	
+	if (dev->transport != NULL)
+		return dev->transport->handle_events(dev->transport, &tv);
 	
-	*len = data - dataOrig;
+	return libusb_handle_events_timeout(dev->ctx, &tv);
 }
 
-static void vfs301_proto_generate(int type, int subtype, unsigned char *data, int *len)
+/************************** OUT MESSAGES GENERATION ***************************/
+
+/* Single-byte commands */
+static const unsigned char vfs301_cmd_1B[] = {0x01, 0x04, 0x17, 0x19, 0x1A};
+
+static const unsigned char vfs301_0B_04_msg[39] = {
+	[0] = 0x0B,
+	[21] = 0x04,
+	[35] = 0x9F
+};
+
+static const unsigned char vfs301_0B_05_msg[39] = {
+	[0] = 0x0B,
+	[21] = 0x05,
+	[35] = 0xAB
+};
+
+#define MSG(x) \
+	(*len = sizeof(x), x)
+
+/** Returns the (read-only) data of the given message */
+static const unsigned char *vfs301_proto_generate(int type, int subtype, int *len)
 {
 	switch (type) {
 	case 0x01:
@@ -177,54 +173,54 @@ static void vfs301_proto_generate(int type, int subtype, unsigned char *data, in
 	case 0x17:
 	case 0x19:
 	case 0x1A:
-		*data = type;
 		*len = 1;
-		break;
+		return memchr(vfs301_cmd_1B, type, sizeof(vfs301_cmd_1B));
 	case 0x0B:
-		vfs301_proto_generate_0B(subtype, data, len);
+		switch (subtype) {
+		case 0x04:
+			return MSG(vfs301_0B_04_msg);
+		case 0x05:
+			return MSG(vfs301_0B_05_msg);
+		default:
+			assert(!"unsupported");
+			break;
+		}
 		break;
 	case 0x02D0:
-		{
-			const char **dataLs[] = {
-				vfs301_02D0_01, 
-				vfs301_02D0_02, 
-				vfs301_02D0_03, 
-				vfs301_02D0_04, 
-				vfs301_02D0_05, 
-				vfs301_02D0_06, 
-				vfs301_02D0_07, 
-			};
-			assert((int)subtype <= (int)(sizeof(dataLs) / sizeof(dataLs[0])));
-			translate_str(dataLs[subtype - 1], data, len);
+		switch (subtype) {
+		case 1:
+			return MSG(vfs301_02D0_01_msg);
+		case 2:
+			return MSG(vfs301_02D0_02_msg);
+		case 3:
+			return MSG(vfs301_02D0_03_msg);
+		case 4:
+			return MSG(vfs301_02D0_04_msg);
+		case 5:
+			return MSG(vfs301_02D0_05_msg);
+		case 6:
+			return MSG(vfs301_02D0_06_msg);
+		case 7:
+			return MSG(vfs301_02D0_07_msg);
+		default:
+			assert(0);
+			break;
 		}
 		break;
 	case 0x0220:
 		switch (subtype) {
 		case 1:
-			translate_str(vfs301_0220_01, data, len);
-			break;
+			return MSG(vfs301_0220_01_msg);
 		case 2:
-			translate_str(vfs301_0220_02, data, len);
-			break;
+			return MSG(vfs301_0220_02_msg);
 		case 3:
-			translate_str(vfs301_0220_03, data, len);
-			break;
+			return MSG(vfs301_0220_03_msg);
 		case 0xFA00:
+			return MSG(vfs301_next_scan_FA00_msg);
 		case 0x2C01:
+			return MSG(vfs301_next_scan_2C01_msg);
 		case 0x5E01:
-			translate_str(vfs301_next_scan_template, data, len);
-			unsigned char *field = data + *len - (sizeof(S4_TAIL) - 1) / 2 - 4;
-			
-			assert(*field == 0xDE);
-			assert(*(field + 1) == 0xAD);
-			assert(*(field + 2) == 0xDE);
-			assert(*(field + 3) == 0xAD);
-			
-			*field = (unsigned char)((subtype >> 8) & 0xFF);
-			*(field + 1) = (unsigned char)(subtype & 0xFF);
-			*(field + 2) = *field;
-			*(field + 3) = *(field + 1);
-			break;
+			return MSG(vfs301_next_scan_5E01_msg);
 		default:
 			assert(0);
 			break;
@@ -237,406 +233,1750 @@ static void vfs301_proto_generate(int type, int subtype, unsigned char *data, in
 		assert(!"Unknown message type");
 		break;
 	}
+
+	*len = 0;
+	return NULL;
+}
+
+const unsigned char *vfs301_proto_message(int type, int subtype, int *len)
+{
+	return vfs301_proto_generate(type, subtype, len);
 }
 
 /************************** SCAN IMAGE PROCESSING *****************************/
 
-#ifdef SCAN_FINISH_DETECTION
-static int img_is_finished_scan(fp_line_t *lines, int no_lines)
+/** The level of the frame sums - the finger makes some of them go up */
+static int img_sum_level(const vfs301_line_t *line)
 {
-	int i;
+	int level = 0;
 	int j;
-	int rv = 1;
 	
-	for (i = no_lines - VFS301_FP_SUM_LINES; i < no_lines; i++) {
-		/* check the line for fingerprint data */
-		for (j = 0; j < sizeof(lines[i].sum2); j++) {
-			if (lines[i].sum2[j] > (VFS301_FP_SUM_MEDIAN + VFS301_FP_SUM_EMPTY_RANGE))
-				rv = 0;
-		}
+	for (j = 0; j < (int)sizeof(line->sum2); j++) {
+		if (line->sum2[j] > level)
+			level = line->sum2[j];
 	}
 	
-	return rv;
+	return level;
 }
-#endif
 
-static int scanline_diff(const unsigned char *scanlines, int prev, int cur)
+/** Calibrate the noise level from a window of empty frames; the windows
+ * with the finger (or anything else) in them are thrown away */
+static void img_lift_calibrate(vfs301_dev_t *dev, int level)
 {
-	const unsigned char *line1 = 
-		scanlines + prev * VFS301_FP_OUTPUT_WIDTH;
-	const unsigned char *line2 = 
-		scanlines + cur * VFS301_FP_OUTPUT_WIDTH;
-	int i;
-	int diff;
+	if (dev->lift_calib_count == 0) {
+		dev->lift_calib_sum = 0;
+		dev->lift_calib_min = level;
+		dev->lift_calib_max = level;
+	}
 	
-#ifdef OUTPUT_RAW
-	/* We only need the image, not the surrounding stuff. */
-	line1 = ((vfs301_line_t*)line1)->scan;
-	line2 = ((vfs301_line_t*)line2)->scan;
-#endif
+	dev->lift_calib_count++;
+	dev->lift_calib_sum += level;
+	dev->lift_calib_min = min(dev->lift_calib_min, level);
+	dev->lift_calib_max = max(dev->lift_calib_max, level);
 	
-	/* TODO: This doesn't work too well when there are parallel lines in the 
-	 * fingerprint. */
-	for (diff = 0, i = 0; i < VFS301_FP_WIDTH; i++) {
-		if (*line1 > *line2)
-			diff += *line1 - *line2;
-		else
-			diff += *line2 - *line1;
-		
-		line1++;
-		line2++;
+	if (dev->lift_calib_max - dev->lift_calib_min > 2 * VFS301_FP_SUM_EMPTY_RANGE) {
+		dev->lift_calib_count = 0;
+		return;
 	}
 	
-	return ((diff / VFS301_FP_WIDTH) > VFS301_FP_LINE_DIFF_THRESHOLD);
+	if (dev->lift_calib_count == VFS301_FP_SUM_CALIB_LINES)
+		dev->lift_noise = dev->lift_calib_max;
 }
 
-/** Transform the input data to a normalized fingerprint scan */
-void vfs301_extract_image(
-	vfs301_dev_t *vfs, unsigned char *output, int *output_height
-)
+/** Whether the sums show the finger in the frame - -1 while their noise
+ * level is still being calibrated */
+static int img_frame_finger(vfs301_dev_t *dev, const vfs301_line_t *line)
 {
-	const unsigned char *scanlines = vfs->scanline_buf;
-	int last_line;
-	int i;
-	
-	assert(vfs->scanline_count >= 1);
+	int level = img_sum_level(line);
 	
-	*output_height = 1;
-	memcpy(output, scanlines, VFS301_FP_OUTPUT_WIDTH);
-	last_line = 0;
-	
-	/* The following algorithm is quite trivial - it just picks lines that
-	 * differ more than VFS301_FP_LINE_DIFF_THRESHOLD.
-	 * TODO: A nicer approach would be to pick those lines and then do some kind 
-	 * of bi/tri-linear resampling to get the output (so that we don't get so
-	 * many false edges etc.).
-	 */
-	for (i = 1; i < vfs->scanline_count; i++) {
-		if (scanline_diff(scanlines, last_line, i)) {
-			memcpy(
-				output + VFS301_FP_OUTPUT_WIDTH * (*output_height),
-				scanlines + VFS301_FP_OUTPUT_WIDTH * i,
-				VFS301_FP_OUTPUT_WIDTH
-			);
-			last_line = i;
-			(*output_height)++;
-		}
+	if (dev->lift_noise < 0) {
+		img_lift_calibrate(dev, level);
+		return -1;
 	}
+	
+	return level > dev->lift_noise + VFS301_FP_SUM_EMPTY_RANGE;
 }
 
-static int img_process_data(
-	int first_block, vfs301_dev_t *dev, const unsigned char *buf, int len
-)
+/** Look for the finger going away. Returns 1 once it is gone, i.e.
+ * lift_lines empty frames came after the finger. */
+static int img_detect_lift(vfs301_dev_t *dev, int finger, int line)
 {
-	vfs301_line_t *lines = (vfs301_line_t*)buf;
-	int no_lines = len / sizeof(vfs301_line_t);
-	int i;
-	/*int no_nonempty;*/
-	unsigned char *cur_line;
-	int last_img_height;
-#ifdef SCAN_FINISH_DETECTION
-	int finished_scan;
-#endif
+	int lift_lines = dev->lift_lines > 0 ? dev->lift_lines : VFS301_FP_LIFT_LINES;
 	
-	if (first_block) {
-		last_img_height = 0;
-		dev->scanline_count = no_lines;
-	} else {
-		last_img_height = dev->scanline_count;
-		dev->scanline_count += no_lines;
+	if (dev->lift_lines < 0 || finger < 0)
+		return 0;
+	
+	if (finger) {
+		dev->lift_finger++;
+		dev->lift_empty = 0;
+	} else if (dev->lift_finger > 0 && ++dev->lift_empty >= lift_lines) {
+		dev->lift_line = line;
+		return 1;
 	}
 	
-	dev->scanline_buf = realloc(dev->scanline_buf, dev->scanline_count * VFS301_FP_OUTPUT_WIDTH);
-	assert(dev->scanline_buf != NULL);
+	return 0;
+}
+
+/** Judge the frames at the start of the scan (see VFS301_FP_GATE_LINES).
+ * Returns 1 once the scan is rejected. */
+static int img_gate_frame(
+	vfs301_dev_t *dev, const vfs301_line_t *line, int finger, int frame)
+{
+	static const unsigned char zero[VFS301_FP_WIDTH];
+	const double n = VFS301_FP_WIDTH;
+	const double min_var = n * n * VFS301_FP_CORR_MIN_DEV * VFS301_FP_CORR_MIN_DEV;
+	int sum;
+	double var;
 	
-	for (cur_line = dev->scanline_buf + last_img_height * VFS301_FP_OUTPUT_WIDTH, i = 0; 
-		i < no_lines; 
-		i++, cur_line += VFS301_FP_OUTPUT_WIDTH
-	) {
-#ifndef OUTPUT_RAW
-		memcpy(cur_line, lines[i].scan, VFS301_FP_OUTPUT_WIDTH);
-#else
-		memcpy(cur_line, &lines[i], VFS301_FP_OUTPUT_WIDTH);
-#endif
+	if (dev->gate < 0 || dev->gate_result != VFS301_GATE_PENDING || finger < 0)
+		return 0;
+	
+	if (finger) {
+		sum = vfs301_line_sad(line->scan, zero);
+		var = n * vfs301_line_dot(line->scan, line->scan) - (double)sum * sum;
+		if (line->flag_1 == 0x08 && var >= min_var)
+			dev->gate_good++;
+		dev->gate_finger++;
 	}
 	
-#ifdef SCAN_FINISH_DETECTION
-	finished_scan = img_is_finished_scan(lines, no_lines);
-
-	return !finished_scan;
-#else /* SCAN_FINISH_DETECTION */
-	return 1; //Just continue until data is coming
-#endif
+	if (dev->gate_finger >= VFS301_FP_GATE_LINES)
+		dev->gate_result = 
+			dev->gate_good * 100 >= dev->gate_finger * VFS301_FP_GATE_GOOD_PERCENT ?
+			VFS301_GATE_PASSED : VFS301_GATE_NOISE;
+	else if (dev->gate_finger == 0 && frame + 1 >= VFS301_FP_GATE_EMPTY_LINES)
+		dev->gate_result = VFS301_GATE_NO_FINGER;
+	
+	return dev->gate_result > VFS301_GATE_PASSED;
 }
 
-/************************** PROTOCOL STUFF ************************************/
-
-static unsigned char usb_send_buf[0x2000];
-
-#define USB_RECV(from, len) \
-	usb_recv(dev, devh, from, len)
+/** Watch the frames for the end of the scan - the finger going away, or the
+ * scan turning out to be noise. Returns 1 when it is over. */
+static int img_watch_frames(
+	vfs301_dev_t *dev, const vfs301_line_t *lines, int no_lines, int first_line)
+{
+	int finger;
+	int i;
 	
-#define USB_SEND(type, subtype) \
-	{ \
-		int len; \
-		vfs301_proto_generate(type, subtype, usb_send_buf, &len); \
-		usb_send(devh, usb_send_buf, len); \
+	for (i = 0; i < no_lines; i++) {
+		finger = img_frame_finger(dev, &lines[i]);
+		
+		if (img_gate_frame(dev, &lines[i], finger, first_line + i) ||
+			img_detect_lift(dev, finger, first_line + i))
+			return 1;
 	}
+	
+	return 0;
+}
 
-#define RAW_DATA(x) x, sizeof(x)
-
-#define IS_VFS301_FP_SEQ_START(b) ((b[0] == 0x01) && (b[1] == 0xfe))
-
-static int vfs301_proto_process_data(int first_block, vfs301_dev_t *dev)
+/** Take the lines of a reply to 0x02D0 as a reference for the flat-field
+ * calibration - only the darkest and the brightest reply are kept */
+static void img_calib_reply(vfs301_dev_t *dev, const unsigned char *buf, int len)
 {
+	const vfs301_init_line_t *lines = (const vfs301_init_line_t *)buf;
+	int sums[VFS301_FP_WIDTH] = {0};
+	int count = 0;
+	int level = 0;
 	int i;
-	const unsigned char *buf = dev->recv_buf;
-	int len = dev->recv_len;
+	int x;
 	
-	if (first_block) {
-		assert(len >= VFS301_FP_FRAME_SIZE);
+	for (i = 0; i < len / (int)sizeof(*lines); i++) {
+		if (lines[i].sync_0x01 != 0x01 || lines[i].sync_0xfe != 0xfe)
+			continue;
+		for (x = 0; x < VFS301_FP_WIDTH; x++)
+			sums[x] += lines[i].scan[x];
+		count++;
+	}
+	
+	if (count == 0)
+		return;
+	
+	for (x = 0; x < VFS301_FP_WIDTH; x++) {
+		sums[x] = sums[x] * 16 / count;
+		level += sums[x];
+	}
+	level /= VFS301_FP_WIDTH;
+	
+	for (i = 0; i < 2; i++) {
+		if (dev->calib_lines > 0 && (i == 0 ?
+			level >= dev->calib_ref_level[0] : level <= dev->calib_ref_level[1]))
+			continue;
 		
-		// Skip bytes until start_sequence is found
-		for (i = 0; i < VFS301_FP_FRAME_SIZE; i++, buf++, len--) {
-			if (IS_VFS301_FP_SEQ_START(buf))
-				break;
-		}
+		dev->calib_ref_level[i] = level;
+		for (x = 0; x < VFS301_FP_WIDTH; x++)
+			dev->calib_ref[i][x] = sums[x];
 	}
 	
-	return img_process_data(first_block, dev, buf, len);
+	dev->calib_lines += count;
 }
 
-void vfs301_proto_request_fingerprint(
-	struct libusb_device_handle *devh, vfs301_dev_t *dev)
+/** Build the correction from the references - the darkest one gives the dark
+ * level of each column, the difference to the brightest one its gain. With
+ * just one reference (or two alike), only the dark level is corrected. */
+static void img_calib_tables(vfs301_dev_t *dev)
 {
-	USB_SEND(0x0220, 0xFA00);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); //000000000000
+	int span = dev->calib_ref_level[1] - dev->calib_ref_level[0];
+	int gain;
+	int diff;
+	int x;
+	
+	dev->calib_base = (dev->calib_ref_level[0] + 8) / 16;
+	
+	for (x = 0; x < VFS301_FP_WIDTH; x++) {
+		dev->calib_dark[x] = (dev->calib_ref[0][x] + 8) / 16;
+		
+		diff = dev->calib_ref[1][x] - dev->calib_ref[0][x];
+		if (span < 16 * VFS301_FP_CALIB_MIN_SPAN || diff <= 0)
+			gain = 1024;
+		else
+			gain = 1024 * span / diff;
+		
+		dev->calib_gain[x] = min(max(gain, 1024 / VFS301_FP_CALIB_MAX_GAIN),
+			1024 * VFS301_FP_CALIB_MAX_GAIN);
+	}
 }
 
-int vfs301_proto_peek_event(
-	struct libusb_device_handle *devh, vfs301_dev_t *dev)
+/** Are the output lines flat-field corrected? */
+static int img_flat(const vfs301_dev_t *dev)
 {
-	const char no_event[] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-	const char got_event[] = {0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00};
+#ifndef OUTPUT_RAW
+	return dev->calib_lines > 0 && dev->flat_field >= 0;
+#else
+	/* the raw frames stay raw */
+	(void)dev;
+	return 0;
+#endif
+}
+
+/* Where the output line is in the frame */
+#ifndef OUTPUT_RAW
+#define IMG_LINE_OFFSET (offsetof(vfs301_line_t, scan))
+#else
+#define IMG_LINE_OFFSET (0)
+#endif
 
-	USB_SEND(0x17, -1);
-	assert(USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 7) == 0);
+/** The given scanline of the current scan - either in the block being
+ * processed, or one of the last ones kept from the previous blocks */
+static const unsigned char *vfs301_scanline(const vfs301_dev_t *dev, int line)
+{
+	assert(line >= 0 && line < dev->scanline_count);
 	
-	if (memcmp(dev->recv_buf, no_event, sizeof(no_event)) == 0) {
-		return 0;
-	} else if (memcmp(dev->recv_buf, got_event, sizeof(no_event)) == 0) {
-		return 1;
-	} else {
-		assert(!"unexpected reply to wait");
+	if (line >= dev->scanline_block_first)
+		return dev->scanline_block + 
+			(line - dev->scanline_block_first) * VFS301_FP_FRAME_SIZE + IMG_LINE_OFFSET;
+	
+	assert(line >= dev->scanline_count - VFS301_SCANLINE_HISTORY);
+	return dev->scanline_hist + (line % VFS301_SCANLINE_HISTORY) * VFS301_FP_OUTPUT_WIDTH;
+}
+
+/** Keep the last scanlines of the block that the image extraction still 
+ * needs - the block goes back to the device once processed */
+static void img_keep_history(vfs301_dev_t *dev)
+{
+	int keep;
+	int i;
+	
+	if (dev->resample == VFS301_RESAMPLE_CORR)
+		keep = VFS301_SCANLINE_HISTORY;
+	else if (dev->resample)
+		keep = 1;
+	else
+		keep = 0; /* the lines are compared to the output image */
+	
+	keep = min(keep, dev->scanline_count - dev->scanline_block_first);
+	for (i = dev->scanline_count - keep; i < dev->scanline_count; i++) {
+		memcpy(dev->scanline_hist + (i % VFS301_SCANLINE_HISTORY) * VFS301_FP_OUTPUT_WIDTH,
+			vfs301_scanline(dev, i), VFS301_FP_OUTPUT_WIDTH);
 	}
+	
+	dev->scanline_block = NULL;
+	dev->scanline_block_first = dev->scanline_count;
 }
 
-#define VARIABLE_ORDER(a, b) \
-	{ \
-		int _rv = a;\
-		b; \
-		if (_rv == -7) \
-			a; \
+/** Set up the output image for the scan - in img_output if there is one */
+static int img_reserve(vfs301_dev_t *dev)
+{
+	dev->img_buf = NULL;
+	dev->img_capacity = 0;
+	
+	if (dev->scanline_hist == NULL) {
+		dev->scanline_hist = malloc(VFS301_SCANLINE_HISTORY * VFS301_FP_OUTPUT_WIDTH);
+		if (dev->scanline_hist == NULL)
+			return -1;
+	}
+	
+	if (dev->img_output != NULL) {
+		dev->img_buf = dev->img_output;
+		dev->img_capacity = dev->img_output_lines;
+		return 0;
+	}
+	
+	if (dev->img_alloc == NULL || dev->img_alloc_lines != dev->scanline_max) {
+		free(dev->img_alloc);
+		dev->img_alloc_lines = dev->scanline_max;
+		dev->img_alloc = malloc(dev->img_alloc_lines * VFS301_FP_OUTPUT_WIDTH);
+		if (dev->img_alloc == NULL)
+			return -1;
 	}
+	
+	dev->img_buf = dev->img_alloc;
+	dev->img_capacity = dev->img_alloc_lines;
+	return 0;
+}
 
-static void vfs301_proto_process_event_cb(struct libusb_transfer *transfer)
+static void img_free(vfs301_dev_t *dev)
 {
-	vfs301_dev_t *dev = transfer->user_data;
-	struct libusb_device_handle *devh = transfer->dev_handle;
+	free(dev->scanline_hist);
+	dev->scanline_hist = NULL;
+	dev->scanline_count = 0;
+	
+	free(dev->img_alloc);
+	dev->img_alloc = NULL;
+	dev->img_alloc_lines = 0;
+	dev->img_buf = NULL;
+	dev->img_capacity = 0;
+	dev->img_height = 0;
+}
 
-	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
-		dev->recv_progress = VFS301_FAILURE;
-		goto end;
-	} else if (transfer->actual_length < dev->recv_exp_amt) {
-		// TODO: process the data anyway?
-		dev->recv_progress = VFS301_ENDED;
-		goto end;
-	} else {
-		dev->recv_len = transfer->actual_length;
-		if (!vfs301_proto_process_data(dev->recv_exp_amt == VFS301_FP_RECV_LEN_1, dev)) {
-			dev->recv_progress = VFS301_ENDED;
-			goto end;
-		}
-		
-		dev->recv_exp_amt = VFS301_FP_RECV_LEN_2;
-		libusb_fill_bulk_transfer(
-			transfer, devh, VFS301_RECEIVE_ENDPOINT_DATA,
-			dev->recv_buf, dev->recv_exp_amt,
-			vfs301_proto_process_event_cb, dev, VFS301_FP_RECV_TIMEOUT);
-		
-		if (libusb_submit_transfer(transfer) < 0) {
-			printf("cb::continue fail\n");
-			dev->recv_progress = VFS301_FAILURE;
-			goto end;
-		}
-		return;
-	}
+static int scanline_diff(const unsigned char *line1, const unsigned char *line2)
+{
+#ifdef OUTPUT_RAW
+	/* We only need the image, not the surrounding stuff. */
+	line1 = ((vfs301_line_t*)line1)->scan;
+	line2 = ((vfs301_line_t*)line2)->scan;
+#endif
 	
-end:
-	libusb_free_transfer(transfer);
+	/* TODO: This doesn't work too well when there are parallel lines in the 
+	 * fingerprint. */
+	return ((vfs301_line_sad(line1, line2) / VFS301_FP_WIDTH) > VFS301_FP_LINE_DIFF_THRESHOLD);
 }
 
-void vfs301_proto_process_event_start(
-	struct libusb_device_handle *devh, vfs301_dev_t *dev)
+/** Add the scanline to the output image if it belongs there. Called for
+ * each received scanline, so the image is ready as soon as the scan ends. */
+static void img_extract_line(vfs301_dev_t *dev, int line)
 {
-	struct libusb_transfer *transfer;
+	const unsigned char *scanline = vfs301_scanline(dev, line);
+	unsigned char *out = dev->img_buf + VFS301_FP_OUTPUT_WIDTH * dev->img_height;
 	
-	/* 
-	 * Notes:
-	 * 
-	 * seen next_scan order:
-	 *    o FA00
-	 *    o FA00
-	 *    o 2C01
-	 *    o FA00
-	 *    o FA00
-	 *    o 2C01
-	 *    o FA00
-	 *    o FA00
-	 *    o 2C01
-	 *    o 5E01 !?
-	 *    o FA00
-	 *    o FA00
-	 *    o 2C01
-	 *    o FA00
-	 *    o FA00
-	 *    o 2C01
+	/* The following algorithm is quite trivial - it just picks lines that
+	 * differ more than VFS301_FP_LINE_DIFF_THRESHOLD from the last picked 
+	 * one (i.e. the last line of the image).
+	 * TODO: A nicer approach would be to pick those lines and then do some kind 
+	 * of bi/tri-linear resampling to get the output (so that we don't get so
+	 * many false edges etc.).
 	 */
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 64);
+	if (dev->img_height >= dev->img_capacity)
+		return;
 	
-	/* now read the fingerprint data, while there are some */
-	transfer = libusb_alloc_transfer(0);
-	if (!transfer) {
-		dev->recv_progress = VFS301_FAILURE;
+	if (!img_flat(dev)) {
+		if (dev->img_height == 0 || scanline_diff(out - VFS301_FP_OUTPUT_WIDTH, scanline)) {
+			memcpy(out, scanline, VFS301_FP_OUTPUT_WIDTH);
+			dev->img_height++;
+		}
 		return;
 	}
 	
-	dev->recv_progress = VFS301_ONGOING;
-	dev->recv_exp_amt = VFS301_FP_RECV_LEN_1;
+	/* the image is corrected, the lines are compared to the last one picked
+	 * as it was */
+	if (dev->img_height == 0 || scanline_diff(dev->img_last_line, scanline)) {
+		memcpy(dev->img_last_line, scanline, VFS301_FP_OUTPUT_WIDTH);
+		vfs301_line_flat(
+			out, scanline, dev->calib_dark, dev->calib_gain, dev->calib_base);
+		dev->img_height++;
+	}
+}
+
+/** The scan as the mirror row sees it */
+static void img_mirror_of_scan(const unsigned char *scan, unsigned char *out)
+{
+	int j;
 	
-	libusb_fill_bulk_transfer(
-		transfer, devh, VFS301_RECEIVE_ENDPOINT_DATA,
-		dev->recv_buf, dev->recv_exp_amt,
-		vfs301_proto_process_event_cb, dev, VFS301_FP_RECV_TIMEOUT);
+	for (j = 0; j < VFS301_FP_MIRROR_WIDTH; j++)
+		out[j] = 255 - scan[j * VFS301_FP_WIDTH / VFS301_FP_MIRROR_WIDTH];
+}
+
+static int img_mirror_sad(const unsigned char *mirror1, const unsigned char *mirror2)
+{
+	int diff = 0;
+	int j;
 	
-	if (libusb_submit_transfer(transfer) < 0) {
-		libusb_free_transfer(transfer);
-		dev->recv_progress = VFS301_FAILURE;
-		return;
-	}
+	for (j = 0; j < VFS301_FP_MIRROR_WIDTH; j++)
+		diff += abs(mirror1[j] - mirror2[j]);
+	
+	return diff;
 }
 
-int /* vfs301_dev_t::recv_progress */ vfs301_proto_process_event_poll(
-	struct libusb_device_handle *devh, vfs301_dev_t *dev)
+/** Update the finger speed by the frame - look for the earlier frame whose
+ * mirror saw what the scan sees now */
+static void img_motion_frame(vfs301_dev_t *dev, const vfs301_line_t *line)
 {
-	if (dev->recv_progress != VFS301_ENDED)
-		return dev->recv_progress;
+	unsigned char seen[VFS301_FP_MIRROR_WIDTH];
+	int lags = min(dev->motion_frames, VFS301_FP_MOTION_MAX_LAG);
+	int best = 0;
+	int best_sad = 0;
+	int total = 0;
+	int sad;
+	int k;
 	
-	/* Finish the scan process... */
+	img_mirror_of_scan(line->scan, seen);
 	
-	USB_SEND(0x04, -1);
-	/* the following may come in random order, data may not come at all, don't
-	* try for too long... */
-	VARIABLE_ORDER(
-		USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2), //1204
-		USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 16384)
-	);
+	for (k = 1; k <= lags; k++) {
+		sad = img_mirror_sad(seen, 
+			dev->motion_mirrors[(dev->motion_frames - k) % VFS301_FP_MOTION_MAX_LAG]);
+		total += sad;
+		if (best == 0 || sad < best_sad) {
+			best = k;
+			best_sad = sad;
+		}
+	}
 	
-	USB_SEND(0x0220, 2);
-	VARIABLE_ORDER(
-		USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 5760), //seems to come always
-		USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2) //0000
-	);
+	/* Only a clear match counts (there's nothing to match in the empty
+	 * frames), and the speed is smoothed a bit over the frames */
+	if (lags > 1 && best_sad * 2 * lags < total) {
+		dev->motion_speed = (3 * dev->motion_speed + 
+			(double)VFS301_FP_MIRROR_DIST / best) / 4;
+		dev->motion_found++;
+	}
 	
-	return dev->recv_progress;
+	memcpy(dev->motion_mirrors[dev->motion_frames % VFS301_FP_MOTION_MAX_LAG],
+		line->mirror + VFS301_FP_MIRROR_OFFSET, VFS301_FP_MIRROR_WIDTH);
+	dev->motion_frames++;
 }
 
-void vfs301_proto_init(struct libusb_device_handle *devh, vfs301_dev_t *dev)
-{
-	USB_SEND(0x01, -1);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 38);
-	USB_SEND(0x0B, 0x04);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 6); //000000000000
-	USB_SEND(0x0B, 0x05);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 7); //00000000000000
-	USB_SEND(0x19, -1);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 64);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 4); //6BB4D0BC
-	usb_send(devh, RAW_DATA(vfs301_06_1));
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); //0000
-	
-	USB_SEND(0x01, -1);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 38);
-	USB_SEND(0x1A, -1);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); //0000
-	usb_send(devh, RAW_DATA(vfs301_06_2));
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); //0000
-	USB_SEND(0x0220, 1);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); //0000
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 256);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 32);
-	
-	USB_SEND(0x1A, -1);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); //0000
-	usb_send(devh, RAW_DATA(vfs301_06_3));
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); //0000
-	
-	USB_SEND(0x01, -1);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 38);
-	USB_SEND(0x02D0, 1);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); //0000
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 11648); // 56 * vfs301_init_line_t[]
-	USB_SEND(0x02D0, 2);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); //0000
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 53248); // 2 * 128 * vfs301_init_line_t[]
-	USB_SEND(0x02D0, 3);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); //0000
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 19968); // 96 * vfs301_init_line_t[]
-	USB_SEND(0x02D0, 4);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); //0000
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 5824); // 28 * vfs301_init_line_t[]
-	USB_SEND(0x02D0, 5);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); //0000
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 6656); // 32 * vfs301_init_line_t[]
-	USB_SEND(0x02D0, 6);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); //0000
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 6656); // 32 * vfs301_init_line_t[]
-	USB_SEND(0x02D0, 7);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); //0000
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 832);
-	usb_send(devh, RAW_DATA(vfs301_12));
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); //0000
-	
-	USB_SEND(0x1A, -1);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); //0000
-	usb_send(devh, RAW_DATA(vfs301_06_2));
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); //0000
-	USB_SEND(0x0220, 2);
-	VARIABLE_ORDER(
-		USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2), //0000
-		USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 5760)
-	);
-	
-	USB_SEND(0x1A, -1);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); //0000
-	usb_send(devh, RAW_DATA(vfs301_06_1));
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); //0000
-	
-	USB_SEND(0x1A, -1);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); //0000
-	usb_send(devh, RAW_DATA(vfs301_06_4));
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); //0000
-	usb_send(devh, RAW_DATA(vfs301_24)); /* turns on white */
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); //0000
-	
-	USB_SEND(0x01, -1);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 38);
-	USB_SEND(0x0220, 3);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2368);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 36);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 5760);
-}
-
-void vfs301_proto_deinit(struct libusb_device_handle *devh, vfs301_dev_t *dev)
+/** The scan part of the stored scanline */
+static const unsigned char *img_scan(const vfs301_dev_t *dev, int line)
 {
+	const unsigned char *scan = vfs301_scanline(dev, line);
+	
+#ifdef OUTPUT_RAW
+	scan = ((vfs301_line_t*)scan)->scan;
+#endif
+	
+	return scan;
+}
+
+/** Update the finger speed by the correlation of the scanline with the ones
+ * before it - the further the finger moved, the less they correlate. The
+ * correlation stops at the first scanline without any contrast. */
+static void img_register_line(vfs301_dev_t *dev, int line)
+{
+	static const unsigned char zero[VFS301_FP_WIDTH];
+	const double n = VFS301_FP_WIDTH;
+	const double min_var = n * n * VFS301_FP_CORR_MIN_DEV * VFS301_FP_CORR_MIN_DEV;
+	const unsigned char *scan = img_scan(dev, line);
+	int lags = min(line, VFS301_FP_CORR_MAX_LAG);
+	int sum = vfs301_line_sad(scan, zero);
+	int sum2 = vfs301_line_dot(scan, scan);
+	double var = n * sum2 - (double)sum * sum;
+	double var_k;
+	double corr;
+	double prev = 1;
+	double lag;
+	int j;
+	int k;
+	
+	for (k = 1; k <= lags && var >= min_var; k++) {
+		j = (line - k) % VFS301_FP_CORR_MAX_LAG;
+		var_k = n * dev->corr_sum2[j] - (double)dev->corr_sum[j] * dev->corr_sum[j];
+		if (var_k < min_var)
+			break;
+		
+		corr = (n * vfs301_line_dot(scan, img_scan(dev, line - k)) -
+			(double)sum * dev->corr_sum[j]) / sqrt(var * var_k);
+		
+		if (corr < VFS301_FP_CORR_LEVEL) {
+			/* the lag of the crossing, in between the scanlines */
+			lag = k - 1 + (prev - VFS301_FP_CORR_LEVEL) / (prev - corr);
+			dev->motion_speed = (3 * dev->motion_speed + VFS301_FP_CORR_DIST / lag) / 4;
+			dev->motion_found++;
+			break;
+		}
+		prev = corr;
+	}
+	
+	/* still correlated after all the lags - the finger is slower */
+	if (k > VFS301_FP_CORR_MAX_LAG)
+		dev->motion_speed = min(dev->motion_speed,
+			(double)VFS301_FP_CORR_DIST / VFS301_FP_CORR_MAX_LAG);
+	
+	j = line % VFS301_FP_CORR_MAX_LAG;
+	dev->corr_sum[j] = sum;
+	dev->corr_sum2[j] = sum2;
+}
+
+/** Add the output lines falling between the previous scanline and the given
+ * one - the scanlines are VFS301_FP_MIRROR_DIST / lag px apart, the output
+ * lines 1 px. */
+static void img_resample_line(vfs301_dev_t *dev, int line)
+{
+	double prev = dev->motion_pos;
+	double pos = prev + dev->motion_speed;
+	unsigned char *out = dev->img_buf + VFS301_FP_OUTPUT_WIDTH * dev->img_height;
+	int weight;
+	
+	if (line == 0) {
+		memcpy(out, vfs301_scanline(dev, 0), VFS301_FP_OUTPUT_WIDTH);
+		if (img_flat(dev))
+			vfs301_line_flat(out, out, dev->calib_dark, dev->calib_gain, dev->calib_base);
+		dev->img_height = 1;
+		dev->motion_pos = 0;
+		dev->motion_next = 1;
+		return;
+	}
+	
+	while (dev->motion_next <= pos && dev->img_height < dev->img_capacity) {
+		weight = (int)((dev->motion_next - prev) / (pos - prev) * 256 + 0.5);
+		vfs301_line_lerp(
+			out, vfs301_scanline(dev, line - 1), vfs301_scanline(dev, line),
+			weight, VFS301_FP_OUTPUT_WIDTH);
+		if (img_flat(dev))
+			vfs301_line_flat(out, out, dev->calib_dark, dev->calib_gain, dev->calib_base);
+		out += VFS301_FP_OUTPUT_WIDTH;
+		dev->img_height++;
+		dev->motion_next += 1;
+	}
+	
+	dev->motion_pos = pos;
+}
+
+void vfs301_raw_frames_init(vfs301_raw_frames_t *raw, unsigned char *buf, int capacity)
+{
+	raw->capacity = capacity;
+	raw->count = 0;
+	raw->counter = (unsigned short *)buf;
+	raw->flags = buf + 2 * capacity;
+	raw->scan = raw->flags + capacity;
+	raw->mirror = raw->scan + VFS301_FP_WIDTH * capacity;
+	raw->sums = raw->mirror + VFS301_FP_RAW_MIRROR * capacity;
+}
+
+void vfs301_raw_frame(const vfs301_raw_frames_t *raw, int n, vfs301_line_t *frame)
+{
+	assert(n >= 0 && n < raw->count);
+	
+	memset(frame, 0, sizeof(*frame));
+	frame->sync_0x01 = 0x01;
+	frame->sync_0xfe = 0xfe;
+	frame->counter_lo = raw->counter[n] & 0xFF;
+	frame->counter_hi = raw->counter[n] >> 8;
+	frame->sync_0x08[0] = frame->sync_0x08[1] = 0x08;
+	frame->flag_1 = raw->flags[n];
+	memcpy(frame->scan, raw->scan + VFS301_FP_WIDTH * n, VFS301_FP_WIDTH);
+	memcpy(frame->mirror, raw->mirror + VFS301_FP_RAW_MIRROR * n, VFS301_FP_RAW_MIRROR);
+	memcpy(frame->sum1, raw->sums + VFS301_FP_RAW_SUMS * n, VFS301_FP_RAW_SUMS);
+}
+
+/** Keep the frames in raw - field by field, so that each array is written
+ * in one go */
+static void img_raw_frames(vfs301_raw_frames_t *raw, const vfs301_line_t *lines, int no_lines)
+{
+	int n = min(no_lines, raw->capacity - raw->count);
+	int i;
+	
+	for (i = 0; i < n; i++) {
+		raw->counter[raw->count + i] = lines[i].counter_lo | (lines[i].counter_hi << 8);
+		raw->flags[raw->count + i] = lines[i].flag_1;
+	}
+	for (i = 0; i < n; i++)
+		memcpy(raw->scan + VFS301_FP_WIDTH * (raw->count + i),
+			lines[i].scan, VFS301_FP_WIDTH);
+	for (i = 0; i < n; i++)
+		memcpy(raw->mirror + VFS301_FP_RAW_MIRROR * (raw->count + i),
+			lines[i].mirror, VFS301_FP_RAW_MIRROR);
+	for (i = 0; i < n; i++)
+		memcpy(raw->sums + VFS301_FP_RAW_SUMS * (raw->count + i),
+			lines[i].sum1, VFS301_FP_RAW_SUMS);
+	
+	raw->count += n;
+}
+
+const unsigned char *vfs301_image(const vfs301_dev_t *dev, int *height)
+{
+	*height = dev->img_height;
+	return dev->img_buf;
+}
+
+/** Transform the input data to a normalized fingerprint scan */
+void vfs301_extract_image(
+	vfs301_dev_t *vfs, unsigned char *output, int *output_height
+)
+{
+	assert(vfs->img_height >= 1);
+	
+	*output_height = vfs->img_height;
+	if (output != vfs->img_buf)
+		memcpy(output, vfs->img_buf, vfs->img_height * VFS301_FP_OUTPUT_WIDTH);
+}
+
+/** Get ready for the frames of a new scan */
+static int img_scan_start(vfs301_dev_t *dev)
+{
+	if (dev->scanline_max <= 0)
+		dev->scanline_max = VFS301_DEFAULT_MAX_SCANLINES;
+	
+	dev->scanline_count = 0;
+	dev->scanline_block_first = 0;
+	dev->scanline_dropped = 0;
+	dev->img_height = 0;
+	if (dev->raw != NULL)
+		dev->raw->count = 0;
+	dev->lift_noise = -1;
+	dev->lift_calib_count = 0;
+	dev->lift_finger = 0;
+	dev->lift_empty = 0;
+	dev->lift_line = -1;
+	dev->gate_finger = 0;
+	dev->gate_good = 0;
+	dev->gate_result = VFS301_GATE_PENDING;
+	dev->motion_frames = 0;
+	dev->motion_found = 0;
+	dev->motion_speed = 1;
+	
+	return img_reserve(dev);
+}
+
+/** Process whole frames, right where they were received */
+static int img_process_data(vfs301_dev_t *dev, const unsigned char *buf, int len)
+{
+	const vfs301_line_t *lines = (const vfs301_line_t*)buf;
+	int no_lines = len / sizeof(vfs301_line_t);
+	int i;
+	/*int no_nonempty;*/
+	int over;
+	
+	/* all the frames count, even those over the limit */
+	over = img_watch_frames(
+		dev, lines, no_lines, dev->scanline_count + dev->scanline_dropped);
+	
+	/* Lines over the limit are just counted */
+	if (no_lines > dev->scanline_max - dev->scanline_count) {
+		dev->scanline_dropped += no_lines - (dev->scanline_max - dev->scanline_count);
+		no_lines = dev->scanline_max - dev->scanline_count;
+	}
+	
+	if (dev->img_buf == NULL)
+		return 0;
+	
+	if (dev->raw != NULL)
+		img_raw_frames(dev->raw, lines, no_lines);
+	
+	/* The frames are used right where they were received */
+	dev->scanline_block = buf;
+	dev->scanline_block_first = dev->scanline_count;
+	
+	for (i = 0; i < no_lines; i++) {
+		dev->scanline_count++;
+		
+		if (dev->resample == VFS301_RESAMPLE_MIRROR)
+			img_motion_frame(dev, &lines[i]);
+		else if (dev->resample == VFS301_RESAMPLE_CORR)
+			img_register_line(dev, dev->scanline_count - 1);
+		if (dev->resample)
+			img_resample_line(dev, dev->scanline_count - 1);
+		else
+			img_extract_line(dev, dev->scanline_count - 1);
+	}
+	
+	img_keep_history(dev);
+	
+	/* Just continue until data is coming, or the finger is gone */
+	return !over;
+}
+
+/************************** PROTOCOL STUFF ************************************/
+
+#define IS_VFS301_FP_SEQ_START(b) ((b[0] == 0x01) && (b[1] == 0xfe))
+
+/** The frame starts by the sync marks */
+static int vfs301_frame_valid(const unsigned char *frame)
+{
+	const vfs301_line_t *line = (const vfs301_line_t *)frame;
+	
+	return IS_VFS301_FP_SEQ_START(frame) && 
+		line->sync_0x08[0] == 0x08 && line->sync_0x08[1] == 0x08;
+}
+
+/** The number of valid frames at the start of buf */
+static int vfs301_frames_valid(const unsigned char *buf, int len)
+{
+	int n;
+	
+	for (n = 0; (n + 1) * VFS301_FP_FRAME_SIZE <= len; n++) {
+		if (!vfs301_frame_valid(buf + n * VFS301_FP_FRAME_SIZE))
+			break;
+	}
+	
+	return n;
+}
+
+/** The stream went out of sync - look for the next frame */
+static void vfs301_frame_skip(vfs301_dev_t *dev)
+{
+	/* the junk before the first frame doesn't count */
+	if (dev->frames_received > 0)
+		dev->frame_lost = 1;
+	
+	dev->frame_synced = 0;
+}
+
+/** Count the valid frames - the frames missing in between show up as the
+ * gaps of their counters */
+static void vfs301_frames_count(vfs301_dev_t *dev, const unsigned char *buf, int count)
+{
+	const vfs301_line_t *lines = (const vfs301_line_t *)buf;
+	int counter;
+	int gap;
+	int i;
+	
+	if (dev->frame_lost) {
+		dev->frames_resynced++;
+		dev->frame_lost = 0;
+	}
+	
+	for (i = 0; i < count; i++) {
+		counter = lines[i].counter_lo | (lines[i].counter_hi << 8);
+		
+		/* the counter wraps around at 16 bits; going back isn't a loss */
+		gap = (counter - dev->frame_counter - 1) & 0xFFFF;
+		if (dev->frame_counter >= 0 && gap > 0 && gap < 0x8000) {
+			dev->frames_dropped += gap;
+			dev->frames_max_gap = max(dev->frames_max_gap, gap);
+		}
+		
+		dev->frame_counter = counter;
+	}
+	
+	dev->frames_received += count;
+}
+
+/* The frames don't have to be aligned to the blocks - there is some junk
+ * at the start of the first one, and the frames may be cut by the end of
+ * any block. Only the frames starting by the sync marks are processed. */
+int vfs301_proto_process_data(
+	int first_block, vfs301_dev_t *dev, const unsigned char *buf, int len)
+{
+	int skip;
+	int n;
+	
+	if (first_block) {
+		dev->frame_part_len = 0;
+		dev->frame_synced = 0;
+		dev->frame_lost = 0;
+		dev->frames_resynced = 0;
+		dev->frame_counter = -1;
+		dev->frames_received = 0;
+		dev->frames_dropped = 0;
+		dev->frames_max_gap = 0;
+		
+		if (img_scan_start(dev) < 0)
+			return 0;
+	}
+	
+	/* the rest of the frame started by the previous block */
+	while (dev->frame_part_len > 0) {
+		n = min(len, VFS301_FP_FRAME_SIZE - dev->frame_part_len);
+		memcpy(dev->frame_part + dev->frame_part_len, buf, n);
+		
+		if (dev->frame_part_len + n < VFS301_FP_FRAME_SIZE) {
+			dev->frame_part_len += n;
+			return 1;
+		}
+		
+		if (vfs301_frame_valid(dev->frame_part)) {
+			dev->frame_part_len = 0;
+			buf += n;
+			len -= n;
+			vfs301_frames_count(dev, dev->frame_part, 1);
+			if (!img_process_data(dev, dev->frame_part, VFS301_FP_FRAME_SIZE))
+				return 0;
+			break;
+		}
+		
+		/* Not a frame after all - the next one may start later in the
+		 * part, or anywhere in this block (none of it is used up yet) */
+		vfs301_frame_skip(dev);
+		skip = 1 + vfs301_find_sync(dev->frame_part + 1, dev->frame_part_len - 1);
+		dev->frame_part_len -= skip;
+		memmove(dev->frame_part, dev->frame_part + skip, dev->frame_part_len);
+		if (dev->frame_part_len > 0)
+			dev->frame_synced = 1;
+	}
+	
+	while (len > 0) {
+		if (!dev->frame_synced) {
+			skip = vfs301_find_sync(buf, len);
+			buf += skip;
+			len -= skip;
+			if (len == 0)
+				break;
+			dev->frame_synced = 1;
+		}
+		
+		n = vfs301_frames_valid(buf, len);
+		if (n > 0) {
+			vfs301_frames_count(dev, buf, n);
+			if (!img_process_data(dev, buf, n * VFS301_FP_FRAME_SIZE))
+				return 0;
+			buf += n * VFS301_FP_FRAME_SIZE;
+			len -= n * VFS301_FP_FRAME_SIZE;
+		} else if (len < VFS301_FP_FRAME_SIZE) {
+			/* the rest of the frame comes with the next block */
+			memcpy(dev->frame_part, buf, len);
+			dev->frame_part_len = len;
+			break;
+		} else {
+			/* not a frame after all, look further */
+			vfs301_frame_skip(dev);
+			buf++;
+			len--;
+		}
+	}
+	
+	return 1;
+}
+
+/* Replies to cmd 0x17 */
+static const unsigned char vfs301_no_event[] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+static const unsigned char vfs301_got_event[] = {0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00};
+
+/************************** ASYNC FINGER WAITING ******************************/
+
+/* The device doesn't report the finger by itself, we still have to ask by
+ * cmd 0x17 - but the receive is armed before the request is sent, and the
+ * polls are done more often right after the fingerprint was requested. */
+
+static void vfs301_proto_wait_event_done(vfs301_dev_t *dev)
+{
+	long long now = vfs301_time_us();
+	
+	if (dev->event_state == VFS301_EVENT_CANCELLING) {
+		dev->event_state = VFS301_EVENT_IDLE;
+	} else if (dev->event_error) {
+		dev->event_state = VFS301_EVENT_FAILED;
+	} else if (memcmp(dev->event_buf, vfs301_no_event, sizeof(vfs301_no_event)) == 0) {
+		dev->event_last_empty = now;
+		dev->event_next_poll = now + dev->event_interval * 1000LL;
+		dev->event_interval = min(dev->event_interval * 2, VFS301_EVENT_POLL_MAX);
+		dev->event_state = VFS301_EVENT_SLEEPING;
+	} else if (memcmp(dev->event_buf, vfs301_got_event, sizeof(vfs301_got_event)) == 0) {
+		dev->event_latency = now - dev->event_last_empty;
+		dev->event_state = VFS301_EVENT_GOT;
+		if (dev->event_cb != NULL)
+			dev->event_cb(dev, dev->event_cb_data);
+	} else {
+		assert(!"unexpected reply to wait");
+		dev->event_state = VFS301_EVENT_FAILED;
+	}
+}
+
+static void vfs301_proto_wait_event_cb(struct libusb_transfer *transfer)
+{
+	vfs301_dev_t *dev = transfer->user_data;
+	
+	dev->event_pending--;
+	
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		dev->event_error = 1;
+	} else if (transfer == dev->event_recv && 
+		transfer->actual_length != sizeof(vfs301_no_event)
+	) {
+		dev->event_error = 1;
+	}
+	
+	if (dev->event_error && dev->event_pending > 0) {
+		/* don't wait for the other one - the reply if the request didn't
+		 * go through, or the request if the reply was wrong already */
+		usb_cancel_transfer(dev,
+			transfer == dev->event_recv ? dev->event_send : dev->event_recv);
+		return;
+	}
+	
+	if (dev->event_pending == 0)
+		vfs301_proto_wait_event_done(dev);
+}
+
+static int vfs301_proto_wait_event_submit(
+	vfs301_dev_t *dev)
+{
+	int len;
+	const unsigned char *data = vfs301_proto_generate(0x17, -1, &len);
+	
+	dev->event_error = 0;
+	memset(dev->event_buf, 0xFF, sizeof(dev->event_buf));
+	
+	libusb_fill_bulk_transfer(
+		dev->event_recv, dev->devh, VFS301_RECEIVE_ENDPOINT_CTRL,
+		dev->event_buf, sizeof(vfs301_no_event),
+		vfs301_proto_wait_event_cb, dev, VFS301_DEFAULT_WAIT_TIMEOUT);
+	libusb_fill_bulk_transfer(
+		dev->event_send, dev->devh, VFS301_SEND_ENDPOINT,
+		(unsigned char *)data, len,
+		vfs301_proto_wait_event_cb, dev, VFS301_DEFAULT_WAIT_TIMEOUT);
+	
+	if (usb_submit_transfer(dev, dev->event_recv) < 0)
+		goto fail;
+	dev->event_pending++;
+	
+	if (usb_submit_transfer(dev, dev->event_send) < 0) {
+		/* the recv callback will finish the job */
+		dev->event_error = 1;
+		usb_cancel_transfer(dev, dev->event_recv);
+		dev->event_state = VFS301_EVENT_POLLING;
+		return -1;
+	}
+	dev->event_pending++;
+	
+	dev->event_state = VFS301_EVENT_POLLING;
+	return 0;
+
+fail:
+	dev->event_state = VFS301_EVENT_FAILED;
+	return -1;
+}
+
+int vfs301_proto_wait_event_start(
+	vfs301_dev_t *dev,
+	vfs301_event_cb_t cb, void *user_data)
+{
+	assert(dev->event_pending == 0);
+	
+	if (dev->event_send == NULL)
+		dev->event_send = libusb_alloc_transfer(0);
+	if (dev->event_recv == NULL)
+		dev->event_recv = libusb_alloc_transfer(0);
+	if (dev->event_send == NULL || dev->event_recv == NULL) {
+		dev->event_state = VFS301_EVENT_FAILED;
+		return -1;
+	}
+	
+	dev->event_cb = cb;
+	dev->event_cb_data = user_data;
+	dev->event_interval = VFS301_EVENT_POLL_MIN;
+	dev->event_last_empty = vfs301_time_us();
+	dev->event_latency = 0;
+	
+	return vfs301_proto_wait_event_submit(dev);
+}
+
+int vfs301_proto_wait_event_poll(
+	vfs301_dev_t *dev)
+{
+	switch (dev->event_state) {
+	case VFS301_EVENT_SLEEPING:
+		if (vfs301_time_us() >= dev->event_next_poll)
+			vfs301_proto_wait_event_submit(dev);
+		return VFS301_ONGOING;
+	case VFS301_EVENT_POLLING:
+	case VFS301_EVENT_CANCELLING:
+		return VFS301_ONGOING;
+	case VFS301_EVENT_GOT:
+		return VFS301_ENDED;
+	default:
+		return VFS301_FAILURE;
+	}
+}
+
+int vfs301_proto_wait_event_timeout(vfs301_dev_t *dev)
+{
+	long long left;
+	
+	if (dev->event_state != VFS301_EVENT_SLEEPING)
+		return VFS301_EVENT_POLL_MAX;
+	
+	left = dev->event_next_poll - vfs301_time_us();
+	if (left < 0)
+		return 0;
+	return (int)((left + 999) / 1000);
+}
+
+void vfs301_proto_wait_event_cancel(vfs301_dev_t *dev)
+{
+	switch (dev->event_state) {
+	case VFS301_EVENT_POLLING:
+		dev->event_state = VFS301_EVENT_CANCELLING;
+		usb_cancel_transfer(dev, dev->event_recv);
+		usb_cancel_transfer(dev, dev->event_send);
+		break;
+	case VFS301_EVENT_SLEEPING:
+		dev->event_state = VFS301_EVENT_IDLE;
+		break;
+	default:
+		break;
+	}
+}
+
+/************************** ASYNC MESSAGE SEQUENCES ***************************/
+
+/* A sequence is a table of steps, each sending a message and reading its
+ * replies. All the receives of a step are armed before the message is sent
+ * (so the order of the ctrl/data replies doesn't matter), and the next step
+ * is submitted right from the completion of the last transfer of the
+ * previous one.
+ *
+ * Up to seq_batch consecutive steps are sent at once, without waiting for
+ * the replies in between - each endpoint returns the replies in the order
+ * of the messages, so they still land in the transfers armed for them. That
+ * breaks if a reply doesn't come at all, so the steps which may go without
+ * one end the batch (VFS301_SEQ_BARRIER). */
+
+enum {
+	/* the replies on the ctrl and data endpoints may come in any order */
+	VFS301_SEQ_ANY_ORDER = 1,
+	/* some reply may be missing - nothing is sent behind the step until
+	 * it is over */
+	VFS301_SEQ_BARRIER = 2
+};
+
+typedef struct vfs301_seq_step {
+	const char *name;
+	/* the message - either generated, or raw (when type is 0); nothing is
+	 * sent if neither is set */
+	int type;
+	int subtype;
+	const unsigned char *raw;
+	int raw_len;
+	/* VFS301_SEQ_* */
+	int flags;
+	/* how long to wait for the transfers (ms), 0 = the default */
+	int timeout;
+	struct {
+		unsigned char endpoint;
+		int len;
+	} recv[VFS301_SEQ_MAX_RECV];
+	/* called with each of the replies on the data endpoint, if set */
+	void (*data_reply)(vfs301_dev_t *dev, const unsigned char *buf, int len);
+} vfs301_seq_step_t;
+
+#define RAW_DATA(x) x, sizeof(x)
+
+#define CTRL(len) {VFS301_RECEIVE_ENDPOINT_CTRL, len}
+#define DATA(len) {VFS301_RECEIVE_ENDPOINT_DATA, len}
+#define GEN(type, subtype) type, subtype, NULL, 0
+#define RAW(x) 0, 0, RAW_DATA(x)
+#define NONE 0, 0, NULL, 0
+
+#define SEQ(x) x, (sizeof(x) / sizeof(x[0]))
+
+static void vfs301_proto_seq_submit(vfs301_dev_t *dev);
+
+static void vfs301_proto_seq_cancel(vfs301_dev_t *dev)
+{
+	int i;
+	
+	for (i = 0; i < dev->seq_xfer_count; i++)
+		usb_cancel_transfer(dev, dev->seq_xfers[i].transfer);
+}
+
+/** Did a reply of the step in flight come before the one listed before it
+ * (on another endpoint)? */
+static int vfs301_proto_seq_reordered(vfs301_dev_t *dev, int n)
+{
+	const vfs301_seq_step_t *step = &dev->seq_steps[dev->seq_inflight[n].step];
+	int first = dev->seq_inflight[n].xfer;
+	int i;
+	int j;
+	
+	if (!(step->flags & VFS301_SEQ_ANY_ORDER))
+		return 0;
+	
+	for (i = 0; i < VFS301_SEQ_MAX_RECV && step->recv[i].len > 0; i++) {
+		for (j = i + 1; j < VFS301_SEQ_MAX_RECV && step->recv[j].len > 0; j++) {
+			if (step->recv[i].endpoint != step->recv[j].endpoint &&
+				dev->seq_xfers[first + i].order > 0 && 
+				dev->seq_xfers[first + j].order > 0 &&
+				dev->seq_xfers[first + j].order < dev->seq_xfers[first + i].order)
+				return 1;
+		}
+	}
+	
+	return 0;
+}
+
+/** The first step from the given one that isn't skipped */
+static int vfs301_proto_seq_find(vfs301_dev_t *dev, int step)
+{
+	while (step < dev->seq_count && (dev->seq_skip >> step) & 1)
+		step++;
+	
+	return step;
+}
+
+static void vfs301_proto_seq_end(vfs301_dev_t *dev, int progress)
+{
+	dev->seq_progress = progress;
+	dev->seq_us = vfs301_time_us() - dev->seq_start;
+	
+	if (dev->seq_done != NULL)
+		dev->seq_done(dev);
+}
+
+/** All the transfers of the batch are back */
+static void vfs301_proto_seq_next(vfs301_dev_t *dev)
+{
+	if (dev->seq_error)
+		vfs301_proto_seq_end(dev, VFS301_FAILURE);
+	else if (dev->seq_step == dev->seq_count)
+		vfs301_proto_seq_end(dev, VFS301_ENDED);
+	else
+		vfs301_proto_seq_submit(dev);
+}
+
+static void vfs301_proto_seq_cb(struct libusb_transfer *transfer)
+{
+	vfs301_dev_t *dev = transfer->user_data;
+	const vfs301_seq_step_t *step;
+	int n;
+	int i;
+	
+	for (i = 0; i < dev->seq_xfer_count; i++) {
+		if (dev->seq_xfers[i].transfer == transfer)
+			break;
+	}
+	assert(i < dev->seq_xfer_count);
+	n = dev->seq_xfers[i].inflight;
+	
+#ifdef DEBUG
+	usb_print_packet(
+		!(transfer->endpoint & LIBUSB_ENDPOINT_IN), transfer->status,
+		transfer->buffer, transfer->actual_length);
+#endif
+	
+	dev->seq_pending--;
+	dev->seq_inflight[n].pending--;
+	
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		dev->seq_xfers[i].order = ++dev->seq_completions;
+		
+		step = &dev->seq_steps[dev->seq_inflight[n].step];
+		if (step->data_reply != NULL && transfer->endpoint == VFS301_RECEIVE_ENDPOINT_DATA)
+			step->data_reply(dev, transfer->buffer, transfer->actual_length);
+	} else if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT && 
+		transfer->endpoint != VFS301_SEND_ENDPOINT
+	) {
+		/* the replies were never checked, just go on */
+		dev->seq_timeouts++;
+	} else if (!dev->seq_error) {
+		/* don't wait for the rest of the batch */
+		dev->seq_error = 1;
+		if (dev->seq_pending > 0)
+			vfs301_proto_seq_cancel(dev);
+	}
+	
+	if (dev->seq_inflight[n].pending == 0) {
+		/* the step is over - with more steps in flight, its time is
+		 * counted from the start of the batch */
+		if (dev->seq_step_us != NULL)
+			dev->seq_step_us[dev->seq_inflight[n].step] = 
+				vfs301_time_us() - dev->seq_batch_start;
+		dev->seq_reordered += vfs301_proto_seq_reordered(dev, n);
+	}
+	
+	if (dev->seq_pending == 0)
+		vfs301_proto_seq_next(dev);
+}
+
+/** Submit a transfer of the step in flight n */
+static int vfs301_proto_seq_add(
+	vfs301_dev_t *dev, int n, unsigned char endpoint,
+	unsigned char *data, int len, int timeout)
+{
+	int i = dev->seq_xfer_count;
+	struct libusb_transfer *transfer = dev->seq_xfers[i].transfer;
+	
+	libusb_fill_bulk_transfer(
+		transfer, dev->devh, endpoint, data, len,
+		vfs301_proto_seq_cb, dev, timeout);
+	
+	if (usb_submit_transfer(dev, transfer) < 0)
+		return -1;
+	
+	dev->seq_xfers[i].inflight = n;
+	dev->seq_xfers[i].order = 0;
+	dev->seq_xfer_count++;
+	dev->seq_inflight[n].pending++;
+	dev->seq_pending++;
+	return 0;
+}
+
+static int vfs301_proto_seq_recv_len(const vfs301_seq_step_t *step)
+{
+	int len = 0;
+	int i;
+	
+	for (i = 0; i < VFS301_SEQ_MAX_RECV && step->recv[i].len > 0; i++)
+		len += step->recv[i].len;
+	
+	return len;
+}
+
+/** Send the next batch of steps - up to seq_batch of them, as long as their
+ * replies fit in recv_buf */
+static void vfs301_proto_seq_submit(vfs301_dev_t *dev)
+{
+	const vfs301_seq_step_t *step;
+	const unsigned char *data;
+	int timeout;
+	int offset = 0;
+	int len;
+	int n;
+	int i;
+	
+	dev->seq_batch_start = vfs301_time_us();
+	dev->seq_completions = 0;
+	dev->seq_inflight_count = 0;
+	dev->seq_xfer_count = 0;
+	
+	while (dev->seq_step < dev->seq_count && dev->seq_inflight_count < dev->seq_batch) {
+		step = &dev->seq_steps[dev->seq_step];
+		timeout = step->timeout > 0 ? step->timeout : VFS301_DEFAULT_WAIT_TIMEOUT;
+		
+		len = vfs301_proto_seq_recv_len(step);
+		assert(len <= (int)sizeof(dev->recv_buf));
+		if (offset + len > (int)sizeof(dev->recv_buf))
+			break;
+		
+		n = dev->seq_inflight_count++;
+		dev->seq_inflight[n].step = dev->seq_step;
+		dev->seq_inflight[n].pending = 0;
+		dev->seq_inflight[n].xfer = dev->seq_xfer_count;
+		
+		/* the replies first... */
+		for (i = 0; i < VFS301_SEQ_MAX_RECV && step->recv[i].len > 0; i++) {
+			if (vfs301_proto_seq_add(
+				dev, n, step->recv[i].endpoint,
+				dev->recv_buf + offset, step->recv[i].len, timeout) < 0)
+				goto fail;
+			offset += step->recv[i].len;
+		}
+		
+		/* ...then the message */
+		if (step->raw != NULL) {
+			data = step->raw;
+			len = step->raw_len;
+		} else if (step->type != 0) {
+			data = vfs301_proto_generate(step->type, step->subtype, &len);
+		} else {
+			data = NULL;
+		}
+		
+		if (data != NULL && vfs301_proto_seq_add(
+			dev, n, VFS301_SEND_ENDPOINT, (unsigned char *)data, len, timeout) < 0)
+			goto fail;
+		
+		assert(dev->seq_inflight[n].pending > 0);
+		dev->seq_step = vfs301_proto_seq_find(dev, dev->seq_step + 1);
+		
+		if (step->flags & VFS301_SEQ_BARRIER)
+			break;
+	}
+	
+	return;
+	
+fail:
+	dev->seq_error = 1;
+	if (dev->seq_pending > 0)
+		vfs301_proto_seq_cancel(dev);
+	else
+		vfs301_proto_seq_next(dev);
+}
+
+/** Run the sequence, done() (if any) is called at its end with seq_progress
+ * set; returns -1 if it failed right away (done() was called already as
+ * well). The steps in the skip mask (bit N = step N) are left out. */
+static int vfs301_proto_seq_start(
+	vfs301_dev_t *dev, const vfs301_seq_step_t *steps, int count,
+	unsigned long long skip, int *step_us, void (*done)(vfs301_dev_t *dev))
+{
+	int i;
+	
+	assert(dev->seq_pending == 0);
+	
+	if (dev->seq_batch <= 0)
+		dev->seq_batch = VFS301_SEQ_DEFAULT_BATCH;
+	else if (dev->seq_batch > VFS301_SEQ_MAX_BATCH)
+		dev->seq_batch = VFS301_SEQ_MAX_BATCH;
+	
+	dev->seq_steps = steps;
+	dev->seq_count = count;
+	dev->seq_done = done;
+	dev->seq_step_us = step_us;
+	dev->seq_skip = skip;
+	dev->seq_progress = VFS301_ONGOING;
+	dev->seq_error = 0;
+	dev->seq_timeouts = 0;
+	dev->seq_reordered = 0;
+	dev->seq_xfer_count = 0;
+	dev->seq_start = vfs301_time_us();
+	
+	for (i = 0; i < VFS301_SEQ_MAX_XFERS; i++) {
+		if (dev->seq_xfers[i].transfer == NULL)
+			dev->seq_xfers[i].transfer = libusb_alloc_transfer(0);
+		if (dev->seq_xfers[i].transfer == NULL) {
+			vfs301_proto_seq_end(dev, VFS301_FAILURE);
+			return -1;
+		}
+	}
+	
+	dev->seq_step = vfs301_proto_seq_find(dev, 0);
+	if (dev->seq_step == dev->seq_count) {
+		vfs301_proto_seq_end(dev, VFS301_ENDED);
+		return 0;
+	}
+	
+	vfs301_proto_seq_submit(dev);
+	
+	return (dev->seq_progress == VFS301_FAILURE) ? -1 : 0;
+}
+
+/** Run the sequence and wait for its end, returns 0 on success */
+static int vfs301_proto_seq_run(
+	vfs301_dev_t *dev, const vfs301_seq_step_t *steps, int count)
+{
+	if (vfs301_proto_seq_start(dev, steps, count, 0, NULL, NULL) < 0)
+		return -1;
+	
+	while (dev->seq_progress == VFS301_ONGOING)
+		usb_handle_events(dev, VFS301_DEFAULT_WAIT_TIMEOUT);
+	
+	return (dev->seq_progress == VFS301_ENDED) ? 0 : -1;
+}
+
+/************************** BLOCKING REQUESTS *********************************/
+
+static const vfs301_seq_step_t vfs301_request_steps[] = {
+	{"0220_FA00", GEN(0x0220, 0xFA00), 0, 0, {CTRL(2)}, NULL}, //000000000000
+};
+
+void vfs301_proto_request_fingerprint(
+	vfs301_dev_t *dev)
+{
+	vfs301_proto_seq_run(dev, SEQ(vfs301_request_steps));
+}
+
+static const vfs301_seq_step_t vfs301_peek_steps[] = {
+	{"17",      GEN(0x17, -1),     0, 0, {CTRL(7)}, NULL},
+};
+
+int vfs301_proto_peek_event(
+	vfs301_dev_t *dev)
+{
+	int r = vfs301_proto_seq_run(dev, SEQ(vfs301_peek_steps));
+	
+	assert(r == 0 && dev->seq_timeouts == 0);
+	
+	if (memcmp(dev->recv_buf, vfs301_no_event, sizeof(vfs301_no_event)) == 0) {
+		return 0;
+	} else if (memcmp(dev->recv_buf, vfs301_got_event, sizeof(vfs301_got_event)) == 0) {
+		return 1;
+	} else {
+		assert(!"unexpected reply to wait");
+		return 0;
+	}
+}
+
+/************************** ASYNC SCAN ****************************************/
+
+/* The end of the scan - the replies may come in random order, the data
+ * to 0x04 may not come at all */
+static const vfs301_seq_step_t vfs301_finish_steps[] = {
+	{"04",      GEN(0x04, -1),     VFS301_SEQ_ANY_ORDER | VFS301_SEQ_BARRIER, 0,
+		{CTRL(2), DATA(16384)}, NULL}, //1204
+	{"0220_02", GEN(0x0220, 2),    VFS301_SEQ_ANY_ORDER, 0,
+		{DATA(5760), CTRL(2)}, NULL}, //0000
+};
+
+static void vfs301_proto_finish_done(vfs301_dev_t *dev)
+{
+	/* the errors were never checked here */
+	dev->finish_us = dev->seq_us;
+	dev->finish_reordered = dev->seq_reordered;
+	if (dev->stop_at > 0)
+		dev->stop_us = vfs301_time_us() - dev->stop_at;
+	dev->recv_progress = VFS301_ENDED;
+}
+
+static void vfs301_proto_process_event_cb(struct libusb_transfer *transfer);
+
+static int vfs301_proto_submit_data(
+	vfs301_dev_t *dev, int idx, int len)
+{
+	struct libusb_transfer *transfer = dev->transfers[idx].transfer;
+	
+	libusb_fill_bulk_transfer(
+		transfer, dev->devh, VFS301_RECEIVE_ENDPOINT_DATA,
+		transfer->buffer, len,
+		vfs301_proto_process_event_cb, dev, VFS301_FP_RECV_TIMEOUT);
+	
+	if (usb_submit_transfer(dev, transfer) < 0)
+		return -1;
+	
+	dev->transfers[idx].state = VFS301_XFER_SUBMITTED;
+	dev->transfers_pending++;
+	return 0;
+}
+
+/* Stop the scan - the remaining transfers are cancelled, recv_progress
+ * is set once all of them are back. */
+static void vfs301_proto_stop_data(vfs301_dev_t *dev, int result)
+{
+	int i;
+	
+	if (dev->recv_stopping)
+		return;
+	
+	dev->recv_stopping = 1;
+	dev->recv_result = result;
+	
+	for (i = 0; i < dev->transfer_count; i++) {
+		if (dev->transfers[i].state == VFS301_XFER_SUBMITTED)
+			usb_cancel_transfer(dev, dev->transfers[i].transfer);
+	}
+}
+
+static void vfs301_proto_stopped_early(vfs301_dev_t *dev)
+{
+	long long scan_us;
+	
+	dev->stop_at = vfs301_time_us();
+	scan_us = dev->stop_at - dev->scan_start;
+	
+	if (dev->gate_result > VFS301_GATE_PASSED)
+		dev->gate_us = scan_us;
+	else if (dev->lift_line >= 0)
+		dev->lift_us = scan_us;
+}
+
+/* Process the finished transfers, in the order they were submitted */
+static void vfs301_proto_reap_data(vfs301_dev_t *dev)
+{
+	struct libusb_transfer *transfer;
+	int head;
+	
+	while (dev->transfers[dev->transfer_head].state == VFS301_XFER_DONE) {
+		head = dev->transfer_head;
+		transfer = dev->transfers[head].transfer;
+		dev->transfers[head].state = VFS301_XFER_IDLE;
+		dev->transfer_head = (head + 1) % dev->transfer_count;
+		
+		if (dev->recv_stopping)
+			continue;
+		
+		if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+			vfs301_proto_stop_data(dev, VFS301_FAILURE);
+		} else if (!vfs301_proto_process_data(
+			dev->recv_blocks++ == 0, dev, 
+			transfer->buffer, transfer->actual_length)
+		) {
+			vfs301_proto_stopped_early(dev);
+			vfs301_proto_stop_data(dev, VFS301_ENDED);
+		} else if (transfer->actual_length < transfer->length) {
+			/* the last block, the device has nothing more to send */
+			vfs301_proto_stop_data(dev, VFS301_ENDED);
+		} else if (vfs301_proto_submit_data(dev, head, VFS301_FP_RECV_LEN_2) < 0
+		) {
+			printf("cb::continue fail\n");
+			vfs301_proto_stop_data(dev, VFS301_FAILURE);
+		}
+	}
+	
+	if (dev->recv_stopping && dev->transfers_pending == 0) {
+		if (dev->recv_result == VFS301_ENDED)
+			/* finish the scan process, recv_progress is set at its end */
+			vfs301_proto_seq_start(
+				dev, SEQ(vfs301_finish_steps), 0, NULL, vfs301_proto_finish_done);
+		else
+			dev->recv_progress = dev->recv_result;
+	}
+}
+
+static void vfs301_proto_process_event_cb(struct libusb_transfer *transfer)
+{
+	vfs301_dev_t *dev = transfer->user_data;
+	int i;
+
+	for (i = 0; i < dev->transfer_count; i++) {
+		if (dev->transfers[i].transfer == transfer)
+			break;
+	}
+	assert(i < dev->transfer_count);
+	
+	dev->transfers[i].state = VFS301_XFER_DONE;
+	dev->transfers_pending--;
+	
+	if (dev->transfers_pending == 0 && !dev->recv_stopping)
+		dev->recv_idle_gaps++;
+	
+	vfs301_proto_reap_data(dev);
+}
+
+/** A buffer for the scan data - the frames are processed right in it, so
+ * it is asked from the kernel (usbfs can then DMA right into it) if it can
+ * do that. Returns 1 in dev_mem if it is such a buffer. */
+static unsigned char *vfs301_proto_alloc_data(vfs301_dev_t *dev, int *dev_mem)
+{
+	unsigned char *buf;
+	
+	buf = usb_dev_mem_alloc(dev, VFS301_FP_RECV_LEN_2);
+	*dev_mem = buf != NULL;
+	if (buf == NULL)
+		buf = malloc(VFS301_FP_RECV_LEN_2);
+	
+	return buf;
+}
+
+static void vfs301_proto_free_data(vfs301_dev_t *dev, unsigned char *buf, int dev_mem)
+{
+	if (dev_mem) {
+		usb_dev_mem_free(dev, buf, VFS301_FP_RECV_LEN_2);
+		return;
+	}
+	free(buf);
+}
+
+static int vfs301_proto_alloc_transfers(vfs301_dev_t *dev)
+{
+	struct libusb_transfer *transfer;
+	int i;
+	
+	if (dev->transfer_count <= 0)
+		dev->transfer_count = VFS301_DEFAULT_TRANSFERS;
+	else if (dev->transfer_count > VFS301_MAX_TRANSFERS)
+		dev->transfer_count = VFS301_MAX_TRANSFERS;
+	
+	for (i = 0; i < dev->transfer_count; i++) {
+		if (dev->transfers[i].transfer != NULL)
+			continue;
+		
+		transfer = libusb_alloc_transfer(0);
+		if (!transfer)
+			return -1;
+		
+		transfer->buffer = vfs301_proto_alloc_data(dev, &dev->transfers[i].dev_mem);
+		if (!transfer->buffer) {
+			libusb_free_transfer(transfer);
+			return -1;
+		}
+		dev->transfers[i].transfer = transfer;
+	}
+	
+	return 0;
+}
+
+static void vfs301_proto_free_transfers(vfs301_dev_t *dev)
+{
+	int i;
+	
+	for (i = 0; i < VFS301_MAX_TRANSFERS; i++) {
+		if (dev->transfers[i].transfer == NULL)
+			continue;
+		
+		assert(dev->transfers[i].state != VFS301_XFER_SUBMITTED);
+		vfs301_proto_free_data(
+			dev, dev->transfers[i].transfer->buffer, dev->transfers[i].dev_mem);
+		libusb_free_transfer(dev->transfers[i].transfer);
+		dev->transfers[i].transfer = NULL;
+	}
+}
+
+/* The header of the scan, read before the fingerprint data */
+static const vfs301_seq_step_t vfs301_scan_start_steps[] = {
+	{"data_64", NONE,              0, 0, {DATA(64)}, NULL},
+};
+
+static void vfs301_proto_scan_start_done(vfs301_dev_t *dev)
+{
+	int i;
+	
+	if (dev->seq_progress != VFS301_ENDED) {
+		dev->recv_progress = VFS301_FAILURE;
+		return;
+	}
+	
+	dev->scan_start = vfs301_time_us();
+	dev->lift_line = -1;
+	dev->stop_at = 0;
+	dev->stop_us = 0;
+	dev->gate_result = VFS301_GATE_PENDING;
+	
+	/* Keep the data endpoint busy - the first block is a bit shorter,
+	 * the following ones are queued right behind it. */
+	for (i = 0; i < dev->transfer_count; i++) {
+		if (vfs301_proto_submit_data(
+			dev, i, i == 0 ? VFS301_FP_RECV_LEN_1 : VFS301_FP_RECV_LEN_2) < 0
+		) {
+			vfs301_proto_stop_data(dev, VFS301_FAILURE);
+			if (dev->transfers_pending == 0)
+				dev->recv_progress = VFS301_FAILURE;
+			return;
+		}
+	}
+}
+
+void vfs301_proto_process_event_start(
+	vfs301_dev_t *dev)
+{
+	/* 
+	 * Notes:
+	 * 
+	 * seen next_scan order:
+	 *    o FA00
+	 *    o FA00
+	 *    o 2C01
+	 *    o FA00
+	 *    o FA00
+	 *    o 2C01
+	 *    o FA00
+	 *    o FA00
+	 *    o 2C01
+	 *    o 5E01 !?
+	 *    o FA00
+	 *    o FA00
+	 *    o 2C01
+	 *    o FA00
+	 *    o FA00
+	 *    o 2C01
+	 */
+	if (vfs301_proto_alloc_transfers(dev) < 0) {
+		dev->recv_progress = VFS301_FAILURE;
+		return;
+	}
+	
+	dev->recv_progress = VFS301_ONGOING;
+	dev->recv_stopping = 0;
+	dev->recv_blocks = 0;
+	dev->recv_idle_gaps = 0;
+	dev->transfer_head = 0;
+	
+	/* now read the fingerprint data, while there are some */
+	vfs301_proto_seq_start(
+		dev, SEQ(vfs301_scan_start_steps), 0, NULL, vfs301_proto_scan_start_done);
+}
+
+int /* vfs301_dev_t::recv_progress */ vfs301_proto_process_event_poll(
+	vfs301_dev_t *dev)
+{
+	return dev->recv_progress;
+}
+
+/************************** ASYNC INITIALIZATION ******************************/
+
+/* The init sequence, as captured from the Windows driver. The replies to
+ * 0x02D0 calibrate the flat-field correction. */
+static const vfs301_seq_step_t vfs301_init_steps[] = {
+	{"01",      GEN(0x01, -1),     0, 0, {CTRL(38)}, NULL},
+	{"0B_04",   GEN(0x0B, 0x04),   0, 0, {CTRL(6)}, NULL}, //000000000000
+	{"0B_05",   GEN(0x0B, 0x05),   0, 0, {CTRL(7)}, NULL}, //00000000000000
+	{"19",      GEN(0x19, -1),     0, 0, {CTRL(64), CTRL(4)}, NULL}, //6BB4D0BC
+	{"06_1",    RAW(vfs301_06_1),  0, 0, {CTRL(2)}, NULL}, //0000
+	
+	{"01",      GEN(0x01, -1),     0, 0, {CTRL(38)}, NULL},
+	{"1A",      GEN(0x1A, -1),     0, 0, {CTRL(2)}, NULL}, //0000
+	{"06_2",    RAW(vfs301_06_2),  0, 0, {CTRL(2)}, NULL}, //0000
+	{"0220_01", GEN(0x0220, 1),    0, 0, {CTRL(2), DATA(256), DATA(32)}, NULL},
+	
+	{"1A",      GEN(0x1A, -1),     0, 0, {CTRL(2)}, NULL}, //0000
+	{"06_3",    RAW(vfs301_06_3),  0, 0, {CTRL(2)}, NULL}, //0000
+	
+	{"01",      GEN(0x01, -1),     0, 0, {CTRL(38)}, NULL},
+	{"02D0_01", GEN(0x02D0, 1),    0, 0, {CTRL(2), DATA(11648)}, img_calib_reply}, // 56 * vfs301_init_line_t[]
+	{"02D0_02", GEN(0x02D0, 2),    0, 0, {CTRL(2), DATA(53248)}, img_calib_reply}, // 2 * 128 * vfs301_init_line_t[]
+	{"02D0_03", GEN(0x02D0, 3),    0, 0, {CTRL(2), DATA(19968)}, img_calib_reply}, // 96 * vfs301_init_line_t[]
+	{"02D0_04", GEN(0x02D0, 4),    0, 0, {CTRL(2), DATA(5824)}, img_calib_reply}, // 28 * vfs301_init_line_t[]
+	{"02D0_05", GEN(0x02D0, 5),    0, 0, {CTRL(2), DATA(6656)}, img_calib_reply}, // 32 * vfs301_init_line_t[]
+	{"02D0_06", GEN(0x02D0, 6),    0, 0, {CTRL(2), DATA(6656)}, img_calib_reply}, // 32 * vfs301_init_line_t[]
+	{"02D0_07", GEN(0x02D0, 7),    0, 0, {CTRL(2), DATA(832)}, img_calib_reply},
+	{"12",      RAW(vfs301_12),    0, 0, {CTRL(2)}, NULL}, //0000
+	
+	{"1A",      GEN(0x1A, -1),     0, 0, {CTRL(2)}, NULL}, //0000
+	{"06_2",    RAW(vfs301_06_2),  0, 0, {CTRL(2)}, NULL}, //0000
+	{"0220_02", GEN(0x0220, 2),    VFS301_SEQ_ANY_ORDER, 0,
+		{CTRL(2), DATA(5760)}, NULL}, // variable order
+	
+	{"1A",      GEN(0x1A, -1),     0, 0, {CTRL(2)}, NULL}, //0000
+	{"06_1",    RAW(vfs301_06_1),  0, 0, {CTRL(2)}, NULL}, //0000
+	
+	{"1A",      GEN(0x1A, -1),     0, 0, {CTRL(2)}, NULL}, //0000
+	{"06_4",    RAW(vfs301_06_4),  0, 0, {CTRL(2)}, NULL}, //0000
+	{"24",      RAW(vfs301_24),    0, 0, {CTRL(2)}, NULL}, /* turns on white */
+	
+	{"01",      GEN(0x01, -1),     0, 0, {CTRL(38)}, NULL},
+	{"0220_03", GEN(0x0220, 3),    0, 0, {CTRL(2368), CTRL(36), DATA(5760)}, NULL},
+};
+
+#define VFS301_INIT_STEPS (sizeof(vfs301_init_steps) / sizeof(vfs301_init_steps[0]))
+
+static void vfs301_proto_init_done(vfs301_dev_t *dev)
+{
+	if (dev->seq_progress == VFS301_ENDED && dev->calib_lines > 0)
+		img_calib_tables(dev);
+	else
+		dev->calib_lines = 0;
+	
+	dev->init_us = dev->seq_us;
+	dev->init_timeouts = dev->seq_timeouts;
+	dev->init_progress = dev->seq_progress;
+}
+
+int vfs301_proto_init_start(vfs301_dev_t *dev)
+{
+	assert(VFS301_INIT_STEPS <= VFS301_INIT_MAX_STEPS);
+	
+	dev->init_progress = VFS301_ONGOING;
+	dev->init_timeouts = 0;
+	dev->init_us = 0;
+	memset(dev->init_step_us, 0, sizeof(dev->init_step_us));
+	dev->calib_lines = 0;
+	
+	return vfs301_proto_seq_start(
+		dev, SEQ(vfs301_init_steps), dev->init_skip,
+		dev->init_step_us, vfs301_proto_init_done);
+}
+int vfs301_proto_init_poll(vfs301_dev_t *dev)
+{
+	return dev->init_progress;
+}
+
+int vfs301_proto_init_steps(void)
+{
+	return VFS301_INIT_STEPS;
+}
+
+const char *vfs301_proto_init_step_name(int step)
+{
+	assert(step >= 0 && step < (int)VFS301_INIT_STEPS);
+	return vfs301_init_steps[step].name;
+}
+
+void vfs301_proto_init(vfs301_dev_t *dev)
+{
+	if (vfs301_proto_init_start(dev) < 0)
+		return;
+	
+	while (vfs301_proto_init_poll(dev) == VFS301_ONGOING)
+		usb_handle_events(dev, VFS301_DEFAULT_WAIT_TIMEOUT);
+}
+
+void vfs301_proto_deinit(vfs301_dev_t *dev)
+{
+	int i;
+	
+	vfs301_proto_free_transfers(dev);
+	img_free(dev);
+	
+	assert(dev->event_pending == 0);
+	assert(dev->seq_pending == 0);
+	for (i = 0; i < VFS301_SEQ_MAX_XFERS; i++) {
+		if (dev->seq_xfers[i].transfer != NULL) {
+			libusb_free_transfer(dev->seq_xfers[i].transfer);
+			dev->seq_xfers[i].transfer = NULL;
+		}
+	}
+	
+	if (dev->event_send != NULL) {
+		libusb_free_transfer(dev->event_send);
+		dev->event_send = NULL;
+	}
+	if (dev->event_recv != NULL) {
+		libusb_free_transfer(dev->event_recv);
+		dev->event_recv = NULL;
+	}
 }
@@ -31,22 +31,87 @@ enum {
 #define VFS301_FP_RECV_LEN_1 (84032)
 #define VFS301_FP_RECV_LEN_2 (84096)
 
-typedef struct {
-	/* buffer for received data */
-	unsigned char recv_buf[0x20000];
-	int recv_len;
+/* Default limit of the scanlines per scan */
+#define VFS301_DEFAULT_MAX_SCANLINES (8192)
 
-	/* buffer to hold raw scanlines */
-	unsigned char *scanline_buf;
-	int scanline_count;
-    
-    enum {
-		VFS301_ONGOING = 0,
-		VFS301_ENDED = 1,
-		VFS301_FAILURE = -1
-	} recv_progress;
-	int recv_exp_amt;
-} vfs301_dev_t;
+/* The mirror (see vfs301_line_t) seems to be another sensor row,
+ * VFS301_FP_MIRROR_DIST px ahead of the scan - inverted, and subsampled to
+ * VFS301_FP_MIRROR_WIDTH px at VFS301_FP_MIRROR_OFFSET. The time the finger
+ * takes from one row to the other gives its speed; lags up to
+ * VFS301_FP_MOTION_MAX_LAG frames are looked for. The distance is a guess,
+ * it only sets the scale of the resampled image. */
+#define VFS301_FP_MIRROR_OFFSET (10)
+#define VFS301_FP_MIRROR_WIDTH (53)
+#define VFS301_FP_MIRROR_DIST (8)
+#define VFS301_FP_MOTION_MAX_LAG (64)
+
+/* Registration by correlation: each scanline is correlated with the
+ * VFS301_FP_CORR_MAX_LAG ones before it, the lag where the correlation falls
+ * below VFS301_FP_CORR_LEVEL (interpolated between the frames) is taken as
+ * the time the finger moves by VFS301_FP_CORR_DIST px. Again, the distance
+ * just sets the scale of the image. */
+#define VFS301_FP_CORR_MAX_LAG (16)
+#define VFS301_FP_CORR_LEVEL (0.5)
+#define VFS301_FP_CORR_DIST (2)
+/* scanlines with less contrast (std. deviation in px) carry no information */
+#define VFS301_FP_CORR_MIN_DEV (8)
+
+/* Flat-field calibration - the gains are only found when the brightest and
+ * the darkest of the 0x02D0 replies differ by VFS301_FP_CALIB_MIN_SPAN px on
+ * average, and limited to VFS301_FP_CALIB_MAX_GAIN (either way) */
+#define VFS301_FP_CALIB_MIN_SPAN (16)
+#define VFS301_FP_CALIB_MAX_GAIN (4)
+
+/* Early rejection of the noise scans - a scan is given up when the sums
+ * show no finger in its first VFS301_FP_GATE_EMPTY_LINES frames, or when
+ * less than VFS301_FP_GATE_GOOD_PERCENT of the first VFS301_FP_GATE_LINES
+ * frames with the finger look good: flagged as such (see
+ * vfs301_line_t::flag_1), and with some contrast (VFS301_FP_CORR_MIN_DEV) */
+#define VFS301_FP_GATE_LINES (128)
+#define VFS301_FP_GATE_EMPTY_LINES (512)
+#define VFS301_FP_GATE_GOOD_PERCENT (50)
+
+/* vfs301_dev_t::gate_result */
+enum {
+	/* not decided yet - or the scan ended before */
+	VFS301_GATE_PENDING = 0,
+	VFS301_GATE_PASSED,
+	/* no finger seen in the frame sums */
+	VFS301_GATE_NO_FINGER,
+	/* the frames with the finger are mostly bad */
+	VFS301_GATE_NOISE
+};
+
+/* Scanlines kept from the previous data block - as many as the correlation
+ * looks back */
+#define VFS301_SCANLINE_HISTORY (VFS301_FP_CORR_MAX_LAG)
+
+/* vfs301_dev_t::resample */
+enum {
+	VFS301_RESAMPLE_OFF = 0,
+	/* the speed is estimated from the mirror row */
+	VFS301_RESAMPLE_MIRROR,
+	/* the speed is estimated by the correlation of the scanlines */
+	VFS301_RESAMPLE_CORR
+};
+
+/* Number of bulk transfers kept queued on the data endpoint while scanning */
+#define VFS301_DEFAULT_TRANSFERS (4)
+#define VFS301_MAX_TRANSFERS (16)
+
+/* Interval of the finger-presence polls while waiting for the finger (ms). 
+ * Starts at the minimum after the fingerprint is requested, and grows up to
+ * the maximum while nothing happens. */
+#define VFS301_EVENT_POLL_MIN (10)
+#define VFS301_EVENT_POLL_MAX (80)
+
+/* Message sequences - the init (see vfs301_proto_init_start) and the end
+ * of the scan. Up to seq_batch steps are sent at once (0 = default). */
+#define VFS301_INIT_MAX_STEPS (48)
+#define VFS301_SEQ_MAX_RECV (3)
+#define VFS301_SEQ_DEFAULT_BATCH (1)
+#define VFS301_SEQ_MAX_BATCH (8)
+#define VFS301_SEQ_MAX_XFERS (VFS301_SEQ_MAX_BATCH * (1 + VFS301_SEQ_MAX_RECV))
 
 enum {
 	/* Width of the scanned data in px */
@@ -54,6 +119,12 @@ enum {
 	
 	/* sizeof(fp_line_t) */
 	VFS301_FP_FRAME_SIZE = 288,
+	/* Sizes of the raw frames as kept (see vfs301_raw_frames_t) - the mirror,
+	 * the sums, and the whole frame without the sync marks */
+	VFS301_FP_RAW_MIRROR = 64,
+	VFS301_FP_RAW_SUMS = 16,
+	VFS301_FP_RAW_SIZE = 2 + 1 + VFS301_FP_WIDTH + VFS301_FP_RAW_MIRROR + VFS301_FP_RAW_SUMS,
+	
 	/* Width of output line */
 #ifndef OUTPUT_RAW
 	VFS301_FP_OUTPUT_WIDTH = VFS301_FP_WIDTH,
@@ -61,14 +132,15 @@ enum {
 	VFS301_FP_OUTPUT_WIDTH = VFS301_FP_FRAME_SIZE,
 #endif
 
-	VFS301_FP_SUM_LINES = 3,
-	
-#ifdef SCAN_FINISH_DETECTION
-	/* TODO: The following changes (seen ~60 and ~80) In that 
-	 * case we'll need to calibrate this from empty data somehow... */
-	VFS301_FP_SUM_MEDIAN = 60,
+	/* The sums of the empty frames stay around some noise level (seen ~60
+	 * and ~80, changing between the scans). The level is calibrated from
+	 * VFS301_FP_SUM_CALIB_LINES empty frames at the start of each scan -
+	 * they have to stay within 2 * VFS301_FP_SUM_EMPTY_RANGE. */
+	VFS301_FP_SUM_CALIB_LINES = 32,
 	VFS301_FP_SUM_EMPTY_RANGE = 5,
-#endif
+	
+	/* Empty frames after the finger that end the scan */
+	VFS301_FP_LIFT_LINES = 32,
 
 	/* Minimum average difference between returned lines */
 	VFS301_FP_LINE_DIFF_THRESHOLD = 15,
@@ -77,6 +149,268 @@ enum {
 	VFS301_FP_RECV_TIMEOUT = 2000
 };
 
+/* The raw frames of a scan, kept by their fields - each of the arrays holds
+ * one field of all the frames, one after another, so that the analysis
+ * touches only the bytes it needs. The sync marks are left out, they are
+ * the same in all the frames used. See vfs301_raw_frames_init(). */
+typedef struct {
+	int capacity;
+	int count;
+	unsigned short *counter;
+	/* vfs301_line_t::flag_1 */
+	unsigned char *flags;
+	/* VFS301_FP_WIDTH px per frame */
+	unsigned char *scan;
+	/* VFS301_FP_RAW_MIRROR bytes per frame */
+	unsigned char *mirror;
+	/* sum1, sum2 and sum3 - VFS301_FP_RAW_SUMS bytes per frame */
+	unsigned char *sums;
+} vfs301_raw_frames_t;
+
+struct vfs301_dev;
+struct vfs301_transport;
+struct vfs301_seq_step;
+typedef void (*vfs301_event_cb_t)(struct vfs301_dev *dev, void *user_data);
+
+/* All the state of one reader; the functions below may be used for several
+ * devices at once (from one libusb event loop, or from a thread per device).
+ * The only state shared by all of them is the choice of the image kernels
+ * (vfs301_img.h) - made before main() and then only read, unless changed by
+ * vfs301_img_simd_select() while no device is being used.
+ * The structure should be zeroed before use. */
+typedef struct vfs301_dev {
+	/* USB handle of the device and its libusb context (NULL = default one),
+	 * set by the user */
+	struct libusb_device_handle *devh;
+	struct libusb_context *ctx;
+	/* optional transport replacing libusb on devh (see vfs301_transport.h) */
+	struct vfs301_transport *transport;
+	
+	/* buffer for the replies of the message sequences (the scan data are
+	 * received into the transfers below) */
+	unsigned char recv_buf[0x20000];
+	int recv_len;
+	
+	/* Frame parsing (see vfs301_proto_process_data) - a frame cut by the
+	 * end of a block is put together in frame_part. When a frame doesn't
+	 * start by the sync marks, the stream is searched for the next one;
+	 * frames_resynced counts that. */
+	unsigned char frame_part[VFS301_FP_FRAME_SIZE];
+	int frame_part_len;
+	int frame_synced;
+	int frame_lost;
+	int frames_resynced;
+	/* Frames of the scan received, and missing in between by their counters
+	 * (the most of them at once in frames_max_gap); frame_counter is the
+	 * counter of the last one (-1 = none yet) */
+	int frame_counter;
+	int frames_received;
+	int frames_dropped;
+	int frames_max_gap;
+
+	/* The scanlines aren't stored - they are processed right in the block
+	 * being received, only the last ones the image extraction still needs
+	 * are kept from the previous block (see VFS301_SCANLINE_HISTORY). At most
+	 * scanline_max lines are used per scan (0 = default), the rest is only
+	 * counted in scanline_dropped. */
+	const unsigned char *scanline_block;
+	int scanline_block_first;
+	unsigned char *scanline_hist;
+	int scanline_count;
+	int scanline_max;
+	int scanline_dropped;
+	
+	/* The frames used are kept in raw too, when set by the user (up to its
+	 * capacity) */
+	vfs301_raw_frames_t *raw;
+	
+	/* The output image, extracted from the scanlines while they arrive.
+	 * It is built right in img_output (of img_output_lines lines) when set
+	 * by the user, otherwise in a buffer of scanline_max lines. */
+	unsigned char *img_output;
+	int img_output_lines;
+	unsigned char *img_alloc;
+	int img_alloc_lines;
+	unsigned char *img_buf;
+	int img_capacity;
+	int img_height;
+	/* the scanline last added to the image, if that was corrected */
+	unsigned char img_last_line[VFS301_FP_OUTPUT_WIDTH];
+	
+	/* Motion compensated resampling - when set by the user (see
+	 * VFS301_RESAMPLE_*), the image is resampled to a constant pitch by the
+	 * estimated finger speed, instead of picking the lines that differ
+	 * enough */
+	int resample;
+	/* mirrors of the last frames (ring indexed by the frame number), the
+	 * frames of the scan, the speed (px per frame), the position of the
+	 * last frame and of the next output line (px) */
+	unsigned char motion_mirrors[VFS301_FP_MOTION_MAX_LAG][VFS301_FP_MIRROR_WIDTH];
+	int motion_frames;
+	double motion_speed;
+	double motion_pos;
+	double motion_next;
+	/* number of frames with the speed found */
+	int motion_found;
+	/* sums and sums of squares of the last scanlines, for the correlation
+	 * (ring indexed by the scanline) */
+	int corr_sum[VFS301_FP_CORR_MAX_LAG];
+	int corr_sum2[VFS301_FP_CORR_MAX_LAG];
+	
+	/* Flat-field calibration, from the replies to 0x02D0 during the init
+	 * (calib_lines of them) - the output lines are corrected to
+	 * (line - calib_dark) * calib_gain / 1024 + calib_base, unless
+	 * flat_field is set to -1 */
+	int flat_field;
+	int calib_lines;
+	short calib_dark[VFS301_FP_WIDTH];
+	short calib_gain[VFS301_FP_WIDTH];
+	int calib_base;
+	/* the darkest and the brightest of the replies - their levels, and
+	 * their means per column (in 1/16 px) */
+	int calib_ref_level[2];
+	short calib_ref[2][VFS301_FP_WIDTH];
+    
+    enum {
+		VFS301_ONGOING = 0,
+		VFS301_ENDED = 1,
+		VFS301_FAILURE = -1
+	} recv_progress;
+
+	/* Ring of transfers queued on the data endpoint during the scan;
+	 * transfer_count may be set before the scan (0 = default). */
+	int transfer_count;
+	struct {
+		struct libusb_transfer *transfer;
+		enum {
+			VFS301_XFER_IDLE = 0,
+			VFS301_XFER_SUBMITTED,
+			VFS301_XFER_DONE
+		} state;
+		/* the buffer is from libusb_dev_mem_alloc() */
+		int dev_mem;
+	} transfers[VFS301_MAX_TRANSFERS];
+	int transfer_head;
+	int transfers_pending;
+	
+	/* number of data blocks processed in the current scan */
+	int recv_blocks;
+	/* set when the scan is over, but some transfers are still being
+	 * cancelled; recv_progress is then updated to recv_result */
+	int recv_stopping;
+	int recv_result;
+	
+	/* Number of times the data endpoint was left without any pending
+	 * transfer during the scan */
+	int recv_idle_gaps;
+	
+	/* Finger lift detection - the scan is stopped after lift_lines empty
+	 * frames following the finger (0 = VFS301_FP_LIFT_LINES, -1 = never) */
+	int lift_lines;
+	/* noise level of the frame sums, -1 while not calibrated yet */
+	int lift_noise;
+	int lift_calib_count;
+	int lift_calib_sum;
+	int lift_calib_min;
+	int lift_calib_max;
+	int lift_finger;
+	int lift_empty;
+	/* Scanline after which the finger was gone (-1 = not detected) and the
+	 * time it took to detect it since the start of the scan (in us) */
+	int lift_line;
+	long long lift_us;
+	long long scan_start;
+	/* When the scan was stopped early (by the lift or the noise gate, 0 if
+	 * it wasn't), and the time from then to the end of the scan - the
+	 * cancelling of the queued transfers and the finish sequence (in us) */
+	long long stop_at;
+	long long stop_us;
+	
+	/* Early rejection of the noise scans (0 = on, -1 = off), see
+	 * VFS301_FP_GATE_LINES - the frames with the finger and the good ones
+	 * of them, the result (VFS301_GATE_*) and the time it took since the
+	 * start of the scan (in us) */
+	int gate;
+	int gate_finger;
+	int gate_good;
+	int gate_result;
+	long long gate_us;
+	
+	/* Asynchronous waiting for the finger (see vfs301_proto_wait_event_*) */
+	enum {
+		VFS301_EVENT_IDLE = 0,
+		VFS301_EVENT_SLEEPING,
+		VFS301_EVENT_POLLING,
+		VFS301_EVENT_CANCELLING,
+		VFS301_EVENT_GOT,
+		VFS301_EVENT_FAILED
+	} event_state;
+	struct libusb_transfer *event_send;
+	struct libusb_transfer *event_recv;
+	unsigned char event_buf[8];
+	int event_pending;
+	int event_error;
+	int event_interval;
+	long long event_next_poll;
+	long long event_last_empty;
+	vfs301_event_cb_t event_cb;
+	void *event_cb_data;
+	
+	/* Time between the last "no finger" reply and the callback, i.e. the
+	 * upper bound of the finger detection latency (in us) */
+	long long event_latency;
+	
+	/* The message sequence being run asynchronously; seq_batch may be set
+	 * by the user (see VFS301_SEQ_MAX_BATCH) */
+	const struct vfs301_seq_step *seq_steps;
+	int seq_count;
+	int seq_batch;
+	unsigned long long seq_skip;
+	void (*seq_done)(struct vfs301_dev *dev);
+	int seq_progress;
+	int seq_step;
+	int seq_pending;
+	int seq_error;
+	int seq_timeouts;
+	int seq_reordered;
+	int seq_completions;
+	int *seq_step_us;
+	/* the steps in flight, and their transfers */
+	struct {
+		int step;
+		int pending;
+		/* index of its first transfer in seq_xfers */
+		int xfer;
+	} seq_inflight[VFS301_SEQ_MAX_BATCH];
+	int seq_inflight_count;
+	struct {
+		struct libusb_transfer *transfer;
+		int inflight;
+		int order;
+	} seq_xfers[VFS301_SEQ_MAX_XFERS];
+	int seq_xfer_count;
+	long long seq_start;
+	long long seq_batch_start;
+	long long seq_us;
+	
+	/* Asynchronous initialization (see vfs301_proto_init_start) */
+	int init_progress;
+	/* Init steps left out (bit N = step N), may be set by the user to try
+	 * shorter init sequences */
+	unsigned long long init_skip;
+	/* Number of init replies that didn't come in time (they are ignored) */
+	int init_timeouts;
+	/* Duration of the whole init and of its steps (in us) */
+	long long init_us;
+	int init_step_us[VFS301_INIT_MAX_STEPS];
+	
+	/* Duration of the end of the last scan (in us), and the number of its
+	 * replies that came in the other order than listed - each of those
+	 * used to cost a whole receive timeout */
+	long long finish_us;
+	int finish_reordered;
+} vfs301_dev_t;
+
 /* Arrays of this structure is returned during the initialization as a response 
  * to the 0x02D0 messages.
  * It seems to be always the same - what is it for? Some kind of confirmation?
@@ -120,19 +454,60 @@ typedef struct {
 	unsigned char sum3[3];
 } vfs301_line_t;
 
-void vfs301_proto_init(struct libusb_device_handle *devh, vfs301_dev_t *dev);
-void vfs301_proto_deinit(struct libusb_device_handle *devh, vfs301_dev_t *dev);
+/** Initializes the device, blocks until done */
+void vfs301_proto_init(vfs301_dev_t *dev);
+void vfs301_proto_deinit(vfs301_dev_t *dev);
 
-void vfs301_proto_request_fingerprint(
-	struct libusb_device_handle *devh, vfs301_dev_t *dev);
+/** Start the initialization asynchronously, driven by libusb event handling.
+ * Returns 0 on success. */
+int vfs301_proto_init_start(vfs301_dev_t *dev);
+/** Returns VFS301_ONGOING while initializing, VFS301_ENDED when done and 
+ * VFS301_FAILURE on error */
+int vfs301_proto_init_poll(vfs301_dev_t *dev);
+/** The number of the init steps and their names, see init_step_us */
+int vfs301_proto_init_steps(void);
+const char *vfs301_proto_init_step_name(int step);
+
+void vfs301_proto_request_fingerprint(vfs301_dev_t *dev);
 
 /** returns 0 if no event is ready, or 1 if there is one... */
-int vfs301_proto_peek_event(
-	struct libusb_device_handle *devh, vfs301_dev_t *dev);
-void vfs301_proto_process_event_start(
-	struct libusb_device_handle *devh, vfs301_dev_t *dev);
-int vfs301_proto_process_event_poll(
-	struct libusb_device_handle *devh, vfs301_dev_t *dev);
+int vfs301_proto_peek_event(vfs301_dev_t *dev);
+/** Start waiting for the finger asynchronously. The callback (if any) is
+ * called from libusb event handling once the finger is detected.
+ * Returns 0 on success. */
+int vfs301_proto_wait_event_start(vfs301_dev_t *dev, vfs301_event_cb_t cb, void *user_data);
+/** Drives the waiting, to be called after each libusb event handling.
+ * Returns VFS301_ONGOING while waiting, VFS301_ENDED when the finger is there
+ * and VFS301_FAILURE on error (or when the waiting was cancelled). */
+int vfs301_proto_wait_event_poll(vfs301_dev_t *dev);
+/** Returns the maximum time (in ms) the libusb event handling may block 
+ * before vfs301_proto_wait_event_poll() should be called again */
+int vfs301_proto_wait_event_timeout(vfs301_dev_t *dev);
+void vfs301_proto_wait_event_cancel(vfs301_dev_t *dev);
+
+void vfs301_proto_process_event_start(vfs301_dev_t *dev);
+int vfs301_proto_process_event_poll(vfs301_dev_t *dev);
+
+/** Returns the binary form of the given message (as sent by the driver) */
+const unsigned char *vfs301_proto_message(int type, int subtype, int *len);
+
+/** Process one block of scan data (as received from the data endpoint).
+ * Returns 0 if the scan should be finished. */
+int vfs301_proto_process_data(
+	int first_block, vfs301_dev_t *dev, const unsigned char *buf, int len);
+
+/** Lays the raw frames out in buf, of capacity * VFS301_FP_RAW_SIZE bytes
+ * (aligned for the counters) */
+void vfs301_raw_frames_init(vfs301_raw_frames_t *raw, unsigned char *buf, int capacity);
+/** Puts the n-th raw frame back together, as it was received */
+void vfs301_raw_frame(const vfs301_raw_frames_t *raw, int n, vfs301_line_t *frame);
+
+/** Returns the image of the last scan - img_height lines of
+ * VFS301_FP_OUTPUT_WIDTH px (with resampling, there may be more of them than
+ * scanlines, or none at all if no frame came through). It stays valid until
+ * the next scan starts. */
+const unsigned char *vfs301_image(const vfs301_dev_t *dev, int *height);
 
+/** Copies the image to output (nothing to copy if it is img_output) */
 void vfs301_extract_image(
 	vfs301_dev_t *vfs, unsigned char *output, int *output_height);
@@ -1112,6 +1112,11 @@ static const unsigned char vfs301_24[] = { /* 119 B */
 	// 0x00, 0xF4, 0x01, 0xF4, 0x01, 0x00, 0xB4,
 };
 
+/* The messages below are kept in their (somewhat) human readable form. They
+ * are translated to binary at build time by vfs301_proto_gen, the driver
+ * itself uses the resulting vfs301_proto_messages.h. */
+#ifdef VFS301_PROTO_GEN
+
 #define PACKET(cmd, length, payload)\
 	cmd length payload
 	
@@ -2631,3 +2636,5 @@ const char *vfs301_02D0_07[] = {
 	
 	NULL
 };
+
+#endif /* VFS301_PROTO_GEN */
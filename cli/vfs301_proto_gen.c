@@ -0,0 +1,131 @@
+/*
+ * vfs301/vfs300 fingerprint reader driver
+ * https://github.com/andree182/vfs301
+ *
+ * Copyright (c) 2011-2012 Andrej Krutak <dev@andree.sk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Build-time helper: translates the hex-string messages from
+ * vfs301_proto_fragments.h to binary arrays (vfs301_proto_messages.h), so that
+ * the driver doesn't have to decode them each time they are sent.
+ */
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+
+#define VFS301_PROTO_GEN
+#include "vfs301_proto_fragments.h"
+
+#define HEX_TO_INT(c) \
+	(((c) >= '0' && (c) <= '9') ? ((c) - '0') : ((c) - 'A' + 10))
+
+/* Fails the build if the message doesn't fit in capacity bytes */
+static void translate_str(
+	const char *name, const char **srcL, unsigned char *data, int capacity, int *len)
+{
+	const char *src;
+	unsigned char *dataOrig = data;
+
+	while (*srcL != NULL) {
+		src = *srcL;
+		while (*src != '\0') {
+			assert(*src != '\0');
+			assert(*(src +1) != '\0');
+			if (data - dataOrig >= capacity) {
+				fprintf(stderr, "%s: the message is longer than %d B\n", name, capacity);
+				exit(1);
+			}
+			*data =
+				(unsigned char)((HEX_TO_INT(*src) << 4) | (HEX_TO_INT(*(src + 1))));
+
+			data++;
+			src += 2;
+		}
+
+		srcL++;
+	}
+
+	*len = data - dataOrig;
+}
+
+/* Fill in the subtype into the DEADDEAD placeholder of the next_scan message */
+static void patch_next_scan(int subtype, unsigned char *data, int len)
+{
+	unsigned char *field = data + len - (sizeof(S4_TAIL) - 1) / 2 - 4;
+
+	assert(*field == 0xDE);
+	assert(*(field + 1) == 0xAD);
+	assert(*(field + 2) == 0xDE);
+	assert(*(field + 3) == 0xAD);
+
+	*field = (unsigned char)((subtype >> 8) & 0xFF);
+	*(field + 1) = (unsigned char)(subtype & 0xFF);
+	*(field + 2) = *field;
+	*(field + 3) = *(field + 1);
+}
+
+static void print_array(const char *name, const unsigned char *data, int len)
+{
+	int i;
+
+	printf("static const unsigned char %s[] = { /* %d B */", name, len);
+	for (i = 0; i < len; i++) {
+		if (i % 12 == 0)
+			printf("\n\t");
+		printf("0x%.2X,%s", data[i], (i % 12 == 11 || i == len - 1) ? "" : " ");
+	}
+	printf("\n};\n\n");
+}
+
+static void emit(const char *name, const char **src, int next_scan_subtype)
+{
+	unsigned char data[0x2000];
+	int len;
+
+	translate_str(name, src, data, sizeof(data), &len);
+
+	if (next_scan_subtype != 0)
+		patch_next_scan(next_scan_subtype, data, len);
+
+	print_array(name, data, len);
+}
+
+int main(void)
+{
+	printf("/* Generated by vfs301_proto_gen from vfs301_proto_fragments.h, "
+		"do not edit. */\n\n");
+
+	emit("vfs301_0220_01_msg", vfs301_0220_01, 0);
+	emit("vfs301_0220_02_msg", vfs301_0220_02, 0);
+	emit("vfs301_0220_03_msg", vfs301_0220_03, 0);
+
+	emit("vfs301_next_scan_FA00_msg", vfs301_next_scan_template, 0xFA00);
+	emit("vfs301_next_scan_2C01_msg", vfs301_next_scan_template, 0x2C01);
+	emit("vfs301_next_scan_5E01_msg", vfs301_next_scan_template, 0x5E01);
+
+	emit("vfs301_02D0_01_msg", vfs301_02D0_01, 0);
+	emit("vfs301_02D0_02_msg", vfs301_02D0_02, 0);
+	emit("vfs301_02D0_03_msg", vfs301_02D0_03, 0);
+	emit("vfs301_02D0_04_msg", vfs301_02D0_04, 0);
+	emit("vfs301_02D0_05_msg", vfs301_02D0_05, 0);
+	emit("vfs301_02D0_06_msg", vfs301_02D0_06, 0);
+	emit("vfs301_02D0_07_msg", vfs301_02D0_07, 0);
+
+	return 0;
+}
@@ -0,0 +1,536 @@
+/*
+ * vfs301/vfs300 fingerprint reader driver
+ * https://github.com/andree182/vfs301
+ *
+ * Copyright (c) 2011-2012 Andrej Krutak <dev@andree.sk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+#include <libusb-1.0/libusb.h>
+
+#include "vfs301_transport.h"
+#include "vfs301_record.h"
+
+#define RECORD_HEADER_LEN 23
+#define NEVER (0x7FFFFFFFFFFFFFFFLL)
+
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+
+static long long record_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void put_u32(unsigned char *p, unsigned int v)
+{
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+	p[2] = (v >> 16) & 0xFF;
+	p[3] = (v >> 24) & 0xFF;
+}
+
+static unsigned int get_u32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+/************************** RECORDING *****************************************/
+
+typedef struct {
+	vfs301_transport_t *inner;
+	FILE *f;
+	long long start;
+} record_priv_t;
+
+/* The original callback of a transfer being recorded */
+typedef struct {
+	vfs301_transport_t *tr;
+	libusb_transfer_cb_fn callback;
+	void *user_data;
+	long long submitted;
+} record_xfer_t;
+
+static void record_write(
+	record_priv_t *priv, unsigned char endpoint, int status,
+	long long submitted, int length, int actual, const unsigned char *data)
+{
+	unsigned char hdr[RECORD_HEADER_LEN];
+	int data_len = (endpoint & LIBUSB_ENDPOINT_IN) ? actual : length;
+
+	hdr[0] = VFS301_RECORD_ASYNC;
+	hdr[1] = endpoint;
+	hdr[2] = status;
+	put_u32(hdr + 3, submitted - priv->start);
+	put_u32(hdr + 7, record_time_us() - submitted);
+	put_u32(hdr + 11, length);
+	put_u32(hdr + 15, actual);
+	put_u32(hdr + 19, data_len);
+
+	fwrite(hdr, sizeof(hdr), 1, priv->f);
+	fwrite(data, data_len, 1, priv->f);
+}
+
+static void record_cb(struct libusb_transfer *transfer)
+{
+	record_xfer_t *x = transfer->user_data;
+	record_priv_t *priv = x->tr->priv;
+
+	transfer->callback = x->callback;
+	transfer->user_data = x->user_data;
+
+	record_write(priv, transfer->endpoint, transfer->status,
+		x->submitted, transfer->length, transfer->actual_length, transfer->buffer);
+	free(x);
+
+	transfer->callback(transfer);
+}
+
+static int record_submit_transfer(vfs301_transport_t *tr, struct libusb_transfer *transfer)
+{
+	record_priv_t *priv = tr->priv;
+	record_xfer_t *x;
+	int r;
+
+	x = malloc(sizeof(*x));
+	if (x == NULL)
+		return LIBUSB_ERROR_NO_MEM;
+
+	x->tr = tr;
+	x->callback = transfer->callback;
+	x->user_data = transfer->user_data;
+	x->submitted = record_time_us();
+
+	transfer->callback = record_cb;
+	transfer->user_data = x;
+
+	r = priv->inner->submit_transfer(priv->inner, transfer);
+	if (r < 0) {
+		transfer->callback = x->callback;
+		transfer->user_data = x->user_data;
+		free(x);
+	}
+
+	return r;
+}
+
+static int record_cancel_transfer(vfs301_transport_t *tr, struct libusb_transfer *transfer)
+{
+	record_priv_t *priv = tr->priv;
+
+	return priv->inner->cancel_transfer(priv->inner, transfer);
+}
+
+static int record_handle_events(vfs301_transport_t *tr, struct timeval *tv)
+{
+	record_priv_t *priv = tr->priv;
+
+	return priv->inner->handle_events(priv->inner, tv);
+}
+
+static unsigned char *record_dev_mem_alloc(vfs301_transport_t *tr, size_t length)
+{
+	record_priv_t *priv = tr->priv;
+
+	if (priv->inner->dev_mem_alloc == NULL)
+		return NULL;
+	return priv->inner->dev_mem_alloc(priv->inner, length);
+}
+
+static void record_dev_mem_free(
+	vfs301_transport_t *tr, unsigned char *buf, size_t length)
+{
+	record_priv_t *priv = tr->priv;
+
+	priv->inner->dev_mem_free(priv->inner, buf, length);
+}
+
+static void record_free(vfs301_transport_t *tr)
+{
+	record_priv_t *priv = tr->priv;
+
+	fclose(priv->f);
+	vfs301_transport_free(priv->inner);
+	free(priv);
+	free(tr);
+}
+
+vfs301_transport_t *vfs301_record_new(vfs301_transport_t *inner, const char *fn)
+{
+	vfs301_transport_t *tr;
+	record_priv_t *priv;
+
+	tr = calloc(1, sizeof(*tr));
+	priv = calloc(1, sizeof(*priv));
+	if (tr == NULL || priv == NULL)
+		goto fail;
+
+	priv->f = fopen(fn, "wb");
+	if (priv->f == NULL)
+		goto fail;
+	fwrite(VFS301_RECORD_MAGIC, strlen(VFS301_RECORD_MAGIC), 1, priv->f);
+
+	priv->inner = inner;
+	priv->start = record_time_us();
+
+	tr->submit_transfer = record_submit_transfer;
+	tr->cancel_transfer = record_cancel_transfer;
+	tr->handle_events = record_handle_events;
+	tr->dev_mem_alloc = record_dev_mem_alloc;
+	tr->dev_mem_free = record_dev_mem_free;
+	tr->free = record_free;
+	tr->priv = priv;
+
+	return tr;
+
+fail:
+	free(tr);
+	free(priv);
+	return NULL;
+}
+
+/************************** REPLAY ********************************************/
+
+typedef struct {
+	unsigned char endpoint;
+	unsigned char status;
+	int duration;
+	int actual;
+	int data_len;
+	const unsigned char *data;
+} replay_rec_t;
+
+typedef struct replay_xfer {
+	struct replay_xfer *next;
+	struct libusb_transfer *transfer;
+	/* the record the transfer gets, NULL = out of records */
+	const replay_rec_t *rec;
+	long long ready;
+	int cancelled;
+} replay_xfer_t;
+
+typedef struct replay_dev {
+	struct replay_dev *next;
+	vfs301_replay_t *replay;
+	vfs301_transport_t tr;
+	int realtime;
+
+	unsigned char *file;
+	replay_rec_t *recs;
+	int rec_count;
+	/* next record per endpoint (indexed by endpoint number + 16 for IN) */
+	int cursor[32];
+	/* completion of the last transfer per endpoint */
+	long long last_ready[32];
+
+	replay_xfer_t *xfers;
+	int mismatches;
+} replay_dev_t;
+
+struct vfs301_replay {
+	replay_dev_t *devs;
+};
+
+static int replay_ep_idx(unsigned char endpoint)
+{
+	return (endpoint & 0x0F) + ((endpoint & LIBUSB_ENDPOINT_IN) ? 16 : 0);
+}
+
+static int replay_load(replay_dev_t *rd, const char *fn)
+{
+	FILE *f;
+	long size;
+	long pos;
+	int magic_len = strlen(VFS301_RECORD_MAGIC);
+	const unsigned char *hdr;
+	unsigned int length;
+	unsigned int actual;
+	unsigned int data_len;
+
+	f = fopen(fn, "rb");
+	if (f == NULL)
+		return -1;
+
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	rd->file = malloc(size > 0 ? size : 1);
+	assert(rd->file != NULL);
+	if (size < magic_len || fread(rd->file, size, 1, f) != 1 ||
+		memcmp(rd->file, VFS301_RECORD_MAGIC, magic_len) != 0
+	) {
+		fprintf(stderr, "%s: not a vfs301 recording\n", fn);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	/* every record has the header at least */
+	rd->recs = calloc(size / RECORD_HEADER_LEN + 1, sizeof(*rd->recs));
+	assert(rd->recs != NULL);
+
+	for (pos = magic_len; pos < size; rd->rec_count++) {
+		replay_rec_t *rec = &rd->recs[rd->rec_count];
+
+		hdr = rd->file + pos;
+		if (size - pos < RECORD_HEADER_LEN)
+			goto damaged;
+		length = get_u32(hdr + 11);
+		actual = get_u32(hdr + 15);
+		data_len = get_u32(hdr + 19);
+		if (length > INT_MAX || actual > length ||
+			data_len > size - pos - RECORD_HEADER_LEN)
+			goto damaged;
+
+		rec->endpoint = hdr[1];
+		rec->status = hdr[2];
+		rec->duration = get_u32(hdr + 7);
+		rec->actual = actual;
+		rec->data_len = data_len;
+		rec->data = hdr + RECORD_HEADER_LEN;
+
+		pos += RECORD_HEADER_LEN + data_len;
+	}
+
+	return 0;
+
+damaged:
+	fprintf(stderr, "%s: damaged record at offset %ld\n", fn, pos);
+	return -1;
+}
+
+/** The next record for the endpoint, NULL if there's none */
+static const replay_rec_t *replay_next(replay_dev_t *rd, unsigned char endpoint)
+{
+	int *cursor = &rd->cursor[replay_ep_idx(endpoint)];
+
+	while (*cursor < rd->rec_count && rd->recs[*cursor].endpoint != endpoint)
+		(*cursor)++;
+
+	if (*cursor >= rd->rec_count)
+		return NULL;
+	return &rd->recs[(*cursor)++];
+}
+
+static void replay_complete(replay_xfer_t *x)
+{
+	struct libusb_transfer *t = x->transfer;
+	const replay_rec_t *rec = x->rec;
+
+	t->actual_length = 0;
+
+	if (x->cancelled) {
+		t->status = LIBUSB_TRANSFER_CANCELLED;
+	} else if (rec == NULL) {
+		t->status = LIBUSB_TRANSFER_NO_DEVICE;
+	} else {
+		t->status = rec->status;
+		if (t->endpoint & LIBUSB_ENDPOINT_IN) {
+			t->actual_length = min(rec->data_len, t->length);
+			memcpy(t->buffer, rec->data, t->actual_length);
+		} else {
+			t->actual_length = min(rec->actual, t->length);
+		}
+	}
+}
+
+static int replay_handle_events(vfs301_transport_t *tr, struct timeval *tv)
+{
+	replay_dev_t *rd = tr->priv;
+	vfs301_replay_t *replay = rd->replay;
+	replay_xfer_t *done;
+	replay_xfer_t **done_tail;
+	replay_xfer_t **px;
+	replay_xfer_t *x;
+	struct timespec ts;
+	long long now = record_time_us();
+	long long end;
+	long long wake;
+
+	end = now + (tv != NULL ? tv->tv_sec * 1000000LL + tv->tv_usec : 60000000LL);
+
+	for (;;) {
+		done = NULL;
+		done_tail = &done;
+		wake = end;
+
+		for (rd = replay->devs; rd != NULL; rd = rd->next) {
+			px = &rd->xfers;
+			while ((x = *px) != NULL) {
+				if (!x->cancelled && now < x->ready) {
+					wake = min(wake, x->ready);
+					px = &x->next;
+					continue;
+				}
+				*px = x->next;
+				x->next = NULL;
+				*done_tail = x;
+				done_tail = &x->next;
+			}
+		}
+
+		if (done != NULL) {
+			/* the callbacks may submit new transfers */
+			while ((x = done) != NULL) {
+				done = x->next;
+				replay_complete(x);
+				x->transfer->callback(x->transfer);
+				free(x);
+			}
+			return 0;
+		}
+
+		if (now >= end)
+			return 0;
+
+		ts.tv_sec = (wake - now) / 1000000;
+		ts.tv_nsec = ((wake - now) % 1000000) * 1000;
+		nanosleep(&ts, NULL);
+		now = record_time_us();
+	}
+}
+
+static int replay_submit_transfer(vfs301_transport_t *tr, struct libusb_transfer *transfer)
+{
+	replay_dev_t *rd = tr->priv;
+	replay_xfer_t *x;
+	replay_xfer_t **px;
+	long long now = record_time_us();
+	long long *last_ready = &rd->last_ready[replay_ep_idx(transfer->endpoint)];
+
+	x = calloc(1, sizeof(*x));
+	if (x == NULL)
+		return LIBUSB_ERROR_NO_MEM;
+
+	x->transfer = transfer;
+	x->rec = replay_next(rd, transfer->endpoint);
+	x->ready = now;
+
+	if (x->rec != NULL) {
+		if (!(transfer->endpoint & LIBUSB_ENDPOINT_IN) && (
+			x->rec->data_len != transfer->length ||
+			memcmp(x->rec->data, transfer->buffer, transfer->length) != 0)
+		)
+			rd->mismatches++;
+
+		if (x->rec->status == LIBUSB_TRANSFER_CANCELLED)
+			/* wait for the driver to cancel it again */
+			x->ready = NEVER;
+		else if (rd->realtime)
+			x->ready = max(now + x->rec->duration, *last_ready);
+	}
+	if (x->ready != NEVER)
+		*last_ready = x->ready;
+
+	for (px = &rd->xfers; *px != NULL; px = &(*px)->next)
+		;
+	*px = x;
+
+	return 0;
+}
+
+static int replay_cancel_transfer(vfs301_transport_t *tr, struct libusb_transfer *transfer)
+{
+	replay_dev_t *rd = tr->priv;
+	replay_xfer_t *x;
+
+	for (x = rd->xfers; x != NULL; x = x->next) {
+		if (x->transfer == transfer) {
+			x->cancelled = 1;
+			return 0;
+		}
+	}
+
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+static void replay_free(vfs301_transport_t *tr)
+{
+	replay_dev_t *rd = tr->priv;
+	replay_dev_t **prd;
+
+	for (prd = &rd->replay->devs; *prd != rd; prd = &(*prd)->next)
+		;
+	*prd = rd->next;
+
+	while (rd->xfers != NULL) {
+		replay_xfer_t *x = rd->xfers;
+
+		rd->xfers = x->next;
+		free(x);
+	}
+	free(rd->recs);
+	free(rd->file);
+	free(rd);
+}
+
+vfs301_replay_t *vfs301_replay_new(void)
+{
+	return calloc(1, sizeof(vfs301_replay_t));
+}
+
+void vfs301_replay_free(vfs301_replay_t *replay)
+{
+	assert(replay->devs == NULL);
+	free(replay);
+}
+
+vfs301_transport_t *vfs301_replay_device_new(
+	vfs301_replay_t *replay, const char *fn, int realtime)
+{
+	replay_dev_t *rd = calloc(1, sizeof(*rd));
+
+	if (rd == NULL)
+		return NULL;
+
+	if (replay_load(rd, fn) < 0) {
+		free(rd->recs);
+		free(rd->file);
+		free(rd);
+		return NULL;
+	}
+
+	rd->replay = replay;
+	rd->realtime = realtime;
+
+	rd->tr.submit_transfer = replay_submit_transfer;
+	rd->tr.cancel_transfer = replay_cancel_transfer;
+	rd->tr.handle_events = replay_handle_events;
+	rd->tr.free = replay_free;
+	rd->tr.priv = rd;
+
+	rd->next = replay->devs;
+	replay->devs = rd;
+
+	return &rd->tr;
+}
+
+int vfs301_replay_mismatches(vfs301_transport_t *tr)
+{
+	replay_dev_t *rd = tr->priv;
+
+	return rd->mismatches;
+}
@@ -0,0 +1,64 @@
+/*
+ * vfs301/vfs300 fingerprint reader driver
+ * https://github.com/andree182/vfs301
+ *
+ * Copyright (c) 2011-2012 Andrej Krutak <dev@andree.sk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Recording of the USB traffic of a device, and its replay.
+ *
+ * The file starts with VFS301_RECORD_MAGIC, followed by one record per
+ * completed (asynchronous) transfer, in the order they completed:
+ *
+ *   u8  flags      - reserved, VFS301_RECORD_ASYNC (ignored by the replay,
+ *                    older recordings told the sync transfers apart by it)
+ *   u8  endpoint
+ *   u8  status     - enum libusb_transfer_status
+ *   u32 submitted  - us since the start of the recording
+ *   u32 duration   - us from the submission to the completion
+ *   u32 length     - requested length
+ *   u32 actual     - actual_length
+ *   u32 data_len   - length of the data following (IN: actual, OUT: length)
+ *   data
+ *
+ * All the numbers are little endian.
+ */
+
+#define VFS301_RECORD_MAGIC "VFS301REC1"
+/* All the transfers are asynchronous now, the flags are always this */
+#define VFS301_RECORD_ASYNC 0x01
+
+/** Records all the traffic going through the transport to the file; the
+ * returned transport takes over the inner one (frees it as well). */
+vfs301_transport_t *vfs301_record_new(vfs301_transport_t *inner, const char *fn);
+
+/* Context shared by the replayed devices */
+typedef struct vfs301_replay vfs301_replay_t;
+
+vfs301_replay_t *vfs301_replay_new(void);
+void vfs301_replay_free(vfs301_replay_t *replay);
+
+/** A device replaying the recorded file. The replies come in the recorded
+ * order per endpoint; with realtime set, each transfer takes as long as it
+ * did when recorded, otherwise it completes immediately.
+ * Returns NULL if the file can't be loaded. */
+vfs301_transport_t *vfs301_replay_device_new(
+	vfs301_replay_t *replay, const char *fn, int realtime);
+
+/** Number of the sent messages differing from the recording */
+int vfs301_replay_mismatches(vfs301_transport_t *tr);
@@ -0,0 +1,703 @@
+/*
+ * vfs301/vfs300 fingerprint reader driver
+ * https://github.com/andree182/vfs301
+ *
+ * Copyright (c) 2011-2012 Andrej Krutak <dev@andree.sk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <time.h>
+#include <libusb-1.0/libusb.h>
+
+#include "vfs301_proto.h"
+#include "vfs301_transport.h"
+#include "vfs301_sim.h"
+
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+
+/* Reply of the device to a message, or the scan data stream */
+typedef struct sim_msg {
+	struct sim_msg *next;
+	unsigned char *data;
+	int len;
+	int pos;
+	/* when the data start to be available (us) */
+	long long ready;
+	/* bytes per us for the scan stream, 0 = all available at once */
+	double rate;
+} sim_msg_t;
+
+/* Pending asynchronous transfer */
+typedef struct sim_xfer {
+	struct sim_xfer *next;
+	struct libusb_transfer *transfer;
+	/* earliest completion (each transfer takes latency_us at least), and
+	 * the timeout of IN transfers (0 = none) */
+	long long ready;
+	long long deadline;
+	int cancelled;
+} sim_xfer_t;
+
+typedef struct sim_dev {
+	struct sim_dev *next;
+	vfs301_sim_t *sim;
+	vfs301_transport_t tr;
+	vfs301_sim_params_t params;
+	unsigned char *own_swipe;
+
+	/* replies waiting on the ctrl and data endpoints */
+	sim_msg_t *ctrl;
+	sim_msg_t *data;
+	/* pending transfers, in the order of submission */
+	sim_xfer_t *xfers;
+
+	/* scan requested, the finger comes at finger_at */
+	int armed;
+	long long finger_at;
+	/* SIM_SEEN_* */
+	int init_seen;
+	/* number of scans sent */
+	int scans;
+} sim_dev_t;
+
+enum {
+	SIM_SEEN_24 = 1,
+	SIM_SEEN_02D0 = 2,
+	SIM_SEEN_0220_03 = 4,
+	SIM_SEEN_ALL = 7
+};
+
+struct vfs301_sim {
+	sim_dev_t *devs;
+};
+
+static long long sim_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void sim_sleep_us(long long us)
+{
+	struct timespec ts;
+
+	if (us <= 0)
+		return;
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	nanosleep(&ts, NULL);
+}
+
+/************************** DEVICE DATA ***************************************/
+
+/* The columns of the sensor are a bit off - in the scans, as well as in the
+ * replies to 0x02D0 */
+static int sim_column_offset(int x)
+{
+	return (x * 37) % 11 - 5;
+}
+
+static void sim_frame_mirror(vfs301_line_t *frame, const unsigned char *scan)
+{
+	int i;
+
+	for (i = 0; i < VFS301_FP_MIRROR_WIDTH; i++) {
+		frame->mirror[VFS301_FP_MIRROR_OFFSET + i] =
+			255 - scan[i * VFS301_FP_WIDTH / VFS301_FP_MIRROR_WIDTH];
+	}
+}
+
+void vfs301_sim_frame(
+	vfs301_line_t *frame, const unsigned char *scan, int counter, int finger)
+{
+	int sum = 0;
+	int i;
+
+	memset(frame, 0, sizeof(*frame));
+	frame->sync_0x01 = 0x01;
+	frame->sync_0xfe = 0xfe;
+	frame->counter_lo = counter & 0xFF;
+	frame->counter_hi = (counter >> 8) & 0xFF;
+	frame->sync_0x08[0] = frame->sync_0x08[1] = 0x08;
+	frame->flag_1 = finger ? 0x08 : 0x18;
+	memcpy(frame->scan, scan, VFS301_FP_WIDTH);
+
+	sim_frame_mirror(frame, scan);
+
+	/* the sums stay around 60 for empty lines */
+	for (i = 0; i < VFS301_FP_WIDTH; i++)
+		sum += scan[i];
+	frame->sum1[0] = frame->sum1[1] = 60 + (finger ? 20 : 0);
+	for (i = 0; i < sizeof(frame->sum2); i++)
+		frame->sum2[i] = 60 + (finger ? (255 - sum / VFS301_FP_WIDTH) / 8 : 0);
+}
+
+unsigned char *vfs301_sim_swipe_synthetic(int lines, unsigned int seed)
+{
+	unsigned char *swipe;
+	int i;
+	int x;
+	double pos = 0;
+
+	swipe = malloc(lines * VFS301_FP_WIDTH);
+	assert(swipe != NULL);
+
+	for (i = 0; i < lines; i++) {
+		pos += (rand_r(&seed) % 100) / 200.0;
+		for (x = 0; x < VFS301_FP_WIDTH; x++) {
+			swipe[i * VFS301_FP_WIDTH + x] =
+				((((int)pos + x / 7) % 6) < 3 ? 60 : 190) + rand_r(&seed) % 16;
+		}
+	}
+
+	return swipe;
+}
+
+unsigned char *vfs301_sim_swipe_load(const char *fn, int *lines)
+{
+	FILE *f;
+	int width;
+	int height;
+	int offset;
+	int i;
+	unsigned char line[VFS301_FP_FRAME_SIZE];
+	unsigned char *swipe;
+
+	f = fopen(fn, "rb");
+	if (f == NULL)
+		return NULL;
+
+	if (fscanf(f, "P5 %d %d 255", &width, &height) != 2 || fgetc(f) != '\n')
+		goto fail;
+
+	if (width == VFS301_FP_WIDTH)
+		offset = 0;
+	else if (width == VFS301_FP_FRAME_SIZE)
+		offset = offsetof(vfs301_line_t, scan);
+	else
+		goto fail;
+
+	swipe = malloc(height * VFS301_FP_WIDTH);
+	assert(swipe != NULL);
+
+	for (i = 0; i < height; i++) {
+		if (fread(line, width, 1, f) != 1)
+			break;
+		memcpy(swipe + i * VFS301_FP_WIDTH, line + offset, VFS301_FP_WIDTH);
+	}
+	*lines = i;
+
+	fclose(f);
+	return swipe;
+
+fail:
+	fprintf(stderr, "%s: not a vfs301 scan\n", fn);
+	fclose(f);
+	return NULL;
+}
+
+/** The scan stream - junk, empty lines, the swipe, empty lines */
+static unsigned char *sim_scan_data(sim_dev_t *sd, int *len)
+{
+	unsigned char empty[VFS301_FP_WIDTH];
+	unsigned char *data;
+	vfs301_line_t *frames;
+	int junk = VFS301_FP_RECV_LEN_1 % VFS301_FP_FRAME_SIZE;
+	int empty_lines = sd->params.empty_lines;
+	int count = sd->params.swipe_lines + 2 * empty_lines;
+	int finger = !sd->params.strict_init || sd->init_seen == SIM_SEEN_ALL;
+	int noise_scan = sd->params.noise_scans > 0 &&
+		(sd->scans + 1) % sd->params.noise_scans == 0;
+	unsigned int seed = count + sd->scans++;
+	/* the noise level of the sums changes from scan to scan */
+	int noise = rand_r(&seed) % 21;
+	int px;
+	int i;
+	int j;
+	int in_swipe;
+
+	*len = junk + count * VFS301_FP_FRAME_SIZE;
+	data = calloc(1, *len);
+	assert(data != NULL);
+	frames = (vfs301_line_t *)(data + junk);
+
+	for (i = 0; i < count; i++) {
+		in_swipe = i >= empty_lines && i < empty_lines + sd->params.swipe_lines;
+		if (finger && in_swipe && !noise_scan) {
+			vfs301_sim_frame(
+				&frames[i],
+				sd->params.swipe + (i - empty_lines) * VFS301_FP_WIDTH, i, 1);
+
+			/* the mirror row sees the swipe mirror_lag frames ahead */
+			j = min(i - empty_lines + sd->params.mirror_lag, sd->params.swipe_lines - 1);
+			sim_frame_mirror(&frames[i], sd->params.swipe + j * VFS301_FP_WIDTH);
+		} else {
+			for (j = 0; j < VFS301_FP_WIDTH; j++)
+				empty[j] = 230 + rand_r(&seed) % 16;
+			vfs301_sim_frame(&frames[i], empty, i, 0);
+
+			/* something is there, but not the finger */
+			if (finger && in_swipe) {
+				for (j = 0; j < sizeof(frames[i].sum2); j++)
+					frames[i].sum2[j] += 20;
+			}
+		}
+
+		for (j = 0; j < sizeof(frames[i].sum2); j++)
+			frames[i].sum2[j] += noise + rand_r(&seed) % 3;
+
+		for (j = 0; j < VFS301_FP_WIDTH; j++) {
+			px = frames[i].scan[j] + sim_column_offset(j);
+			frames[i].scan[j] = px < 0 ? 0 : (px > 255 ? 255 : px);
+		}
+	}
+
+	/* cut the first half (with the sync marks) out of every
+	 * glitch_frames-th frame */
+	if (sd->params.glitch_frames > 0) {
+		for (i = 0, j = junk; i < count; i++) {
+			if ((i + 1) % sd->params.glitch_frames == 0) {
+				memmove(data + j, (unsigned char *)&frames[i] + VFS301_FP_FRAME_SIZE / 2,
+					VFS301_FP_FRAME_SIZE / 2);
+				j += VFS301_FP_FRAME_SIZE / 2;
+			} else {
+				memmove(data + j, &frames[i], VFS301_FP_FRAME_SIZE);
+				j += VFS301_FP_FRAME_SIZE;
+			}
+		}
+		*len = j;
+	}
+
+	return data;
+}
+
+/** The replies to 0x02D0 - seemingly always the same */
+static void sim_init_lines(vfs301_init_line_t *lines, int count)
+{
+	int i;
+	int x;
+
+	for (i = 0; i < count; i++) {
+		lines[i].sync_0x01 = 0x01;
+		lines[i].sync_0xfe = 0xfe;
+		lines[i].counter_lo = i & 0xFF;
+		lines[i].counter_hi = (i >> 8) & 0xFF;
+		for (x = 0; x < VFS301_FP_WIDTH; x++)
+			lines[i].scan[x] = 128 + sim_column_offset(x);
+	}
+}
+
+/************************** MESSAGES ******************************************/
+
+static void sim_push(
+	sim_msg_t **queue, unsigned char *data, int len, long long ready, double rate)
+{
+	sim_msg_t *msg = calloc(1, sizeof(*msg));
+
+	assert(msg != NULL);
+	msg->data = data;
+	msg->len = len;
+	msg->ready = ready;
+	msg->rate = rate;
+
+	while (*queue != NULL)
+		queue = &(*queue)->next;
+	*queue = msg;
+}
+
+static void sim_push_copy(
+	sim_msg_t **queue, const unsigned char *data, int len, long long ready)
+{
+	unsigned char *copy = malloc(len > 0 ? len : 1);
+
+	assert(copy != NULL);
+	memcpy(copy, data, len);
+	sim_push(queue, copy, len, ready, 0);
+}
+
+static void sim_push_zeros(sim_msg_t **queue, int len, long long ready)
+{
+	unsigned char *data = calloc(1, len);
+
+	assert(data != NULL);
+	sim_push(queue, data, len, ready, 0);
+}
+
+static void sim_pop(sim_msg_t **queue)
+{
+	sim_msg_t *msg = *queue;
+
+	*queue = msg->next;
+	free(msg->data);
+	free(msg);
+}
+
+static void sim_clear(sim_msg_t **queue)
+{
+	while (*queue != NULL)
+		sim_pop(queue);
+}
+
+/** Number of bytes of the message received by the device until now */
+static int sim_available(const sim_msg_t *msg, long long now)
+{
+	if (now < msg->ready)
+		return 0;
+	if (msg->rate == 0)
+		return msg->len;
+	return min(msg->len, (int)((now - msg->ready) * msg->rate));
+}
+
+/** Queue the replies to a message sent by the driver */
+static void sim_command(sim_dev_t *sd, const unsigned char *buf, int len, long long now)
+{
+	static const unsigned char reply_0000[] = {0x00, 0x00};
+	static const unsigned char reply_1204[] = {0x12, 0x04};
+	static const unsigned char reply_19[] = {0x6B, 0xB4, 0xD0, 0xBC};
+	static const unsigned char got_event[] = {0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00};
+	long long ready = now + sd->params.latency_us;
+	const unsigned char *msg;
+	vfs301_init_line_t *lines;
+	unsigned char *data;
+	int msg_len;
+	int count;
+
+	if (len == 0)
+		return;
+
+	switch (buf[0]) {
+	case 0x01:
+		sim_push_zeros(&sd->ctrl, 38, ready);
+		break;
+	case 0x19:
+		sim_push_zeros(&sd->ctrl, 64, ready);
+		sim_push_copy(&sd->ctrl, reply_19, sizeof(reply_19), ready);
+		break;
+	case 0x0B:
+		/* the subtype (04 / 05) is in the 22nd byte */
+		sim_push_zeros(&sd->ctrl, (len > 21 && buf[21] == 0x05) ? 7 : 6, ready);
+		break;
+	case 0x17:
+		if (sd->armed && now >= sd->finger_at) {
+			sd->armed = 0;
+			sim_push_copy(&sd->ctrl, got_event, sizeof(got_event), ready);
+			sim_push_zeros(&sd->data, 64, ready);
+
+			data = sim_scan_data(sd, &count);
+			sim_push(&sd->data, data, count, ready,
+				sd->params.line_rate * (double)VFS301_FP_FRAME_SIZE / 1e6);
+		} else {
+			sim_push_zeros(&sd->ctrl, sizeof(got_event), ready);
+		}
+		break;
+	case 0x04:
+		/* the end of the scan, the rest of the data is dropped */
+		sd->armed = 0;
+		sim_clear(&sd->data);
+		sim_push_copy(&sd->ctrl, reply_1204, sizeof(reply_1204), ready);
+		break;
+	case 0x02:
+		if (len < 5)
+			break;
+		count = buf[3] | (buf[4] << 8);
+
+		if (buf[1] == 0xD0) {
+			sd->init_seen |= SIM_SEEN_02D0;
+			lines = calloc(count, sizeof(*lines));
+			assert(lines != NULL);
+			sim_init_lines(lines, count);
+			sim_push(&sd->data, (unsigned char *)lines, count * sizeof(*lines), ready, 0);
+			sim_push_copy(&sd->ctrl, reply_0000, sizeof(reply_0000), ready);
+			break;
+		}
+
+		msg = vfs301_proto_message(0x0220, 3, &msg_len);
+		if (len == msg_len && memcmp(buf, msg, len) == 0) {
+			sd->init_seen |= SIM_SEEN_0220_03;
+			sim_push_zeros(&sd->ctrl, 2368, ready);
+			sim_push_zeros(&sd->ctrl, 36, ready);
+			sim_push_zeros(&sd->data, 5760, ready);
+			break;
+		}
+
+		if (count == 0) {
+			/* next_scan: the finger comes after a while */
+			sd->armed = 1;
+			sd->finger_at = now + sd->params.finger_delay_ms * 1000LL;
+		} else {
+			sim_push_zeros(&sd->data, count * VFS301_FP_FRAME_SIZE, ready);
+		}
+		sim_push_copy(&sd->ctrl, reply_0000, sizeof(reply_0000), ready);
+		break;
+	case 0x24:
+		sd->init_seen |= SIM_SEEN_24;
+		sim_push_copy(&sd->ctrl, reply_0000, sizeof(reply_0000), ready);
+		break;
+	default:
+		/* 0x06, 0x12, 0x1A, ... */
+		sim_push_copy(&sd->ctrl, reply_0000, sizeof(reply_0000), ready);
+		break;
+	}
+}
+
+/************************** TRANSFERS *****************************************/
+
+/** Try to complete the transfer from the queue; returns 1 if done, otherwise
+ * updates *wake to the time the data will be there */
+static int sim_serve(sim_msg_t **queue, struct libusb_transfer *transfer,
+	long long now, long long *wake)
+{
+	sim_msg_t *msg = *queue;
+	int need;
+	int avail;
+
+	if (msg == NULL)
+		return 0;
+
+	need = min(transfer->length, msg->len - msg->pos);
+	avail = sim_available(msg, now) - msg->pos;
+	if (avail < need) {
+		if (msg->rate == 0)
+			*wake = min(*wake, msg->ready);
+		else
+			*wake = min(*wake, msg->ready + (long long)((msg->pos + need) / msg->rate) + 1);
+		return 0;
+	}
+
+	memcpy(transfer->buffer, msg->data + msg->pos, need);
+	msg->pos += need;
+	transfer->actual_length = need;
+
+	/* the end of a stream is marked by a short transfer */
+	if (msg->pos == msg->len && (msg->rate == 0 || need < transfer->length))
+		sim_pop(queue);
+
+	return 1;
+}
+
+/** Moves the finished transfers of the device to *done */
+static void sim_dev_process(sim_dev_t *sd, long long now, long long *wake,
+	sim_xfer_t ***done)
+{
+	sim_xfer_t **px = &sd->xfers;
+	sim_xfer_t *x;
+	int blocked_ctrl = 0;
+	int blocked_data = 0;
+	int *blocked;
+	struct libusb_transfer *t;
+
+	while ((x = *px) != NULL) {
+		t = x->transfer;
+		blocked = (t->endpoint == VFS301_RECEIVE_ENDPOINT_CTRL) ? &blocked_ctrl : &blocked_data;
+
+		if (x->cancelled) {
+			t->status = LIBUSB_TRANSFER_CANCELLED;
+		} else if (!(t->endpoint & LIBUSB_ENDPOINT_IN)) {
+			if (now < x->ready) {
+				*wake = min(*wake, x->ready);
+				px = &x->next;
+				continue;
+			}
+			t->status = LIBUSB_TRANSFER_COMPLETED;
+			t->actual_length = t->length;
+		} else if (now < x->ready) {
+			/* still on the way */
+			*blocked = 1;
+			*wake = min(*wake, x->ready);
+			px = &x->next;
+			continue;
+		} else if (!*blocked && sim_serve(
+				(t->endpoint == VFS301_RECEIVE_ENDPOINT_CTRL) ? &sd->ctrl : &sd->data,
+				t, now, wake)) {
+			t->status = LIBUSB_TRANSFER_COMPLETED;
+		} else if (x->deadline != 0 && now >= x->deadline) {
+			t->status = LIBUSB_TRANSFER_TIMED_OUT;
+			t->actual_length = 0;
+		} else {
+			*blocked = 1;
+			if (x->deadline != 0)
+				*wake = min(*wake, x->deadline);
+			px = &x->next;
+			continue;
+		}
+
+		*px = x->next;
+		x->next = NULL;
+		**done = x;
+		*done = &x->next;
+	}
+}
+
+static int sim_handle_events(vfs301_transport_t *tr, struct timeval *tv)
+{
+	sim_dev_t *sd = tr->priv;
+	vfs301_sim_t *sim = sd->sim;
+	sim_xfer_t *done;
+	sim_xfer_t **done_tail;
+	sim_xfer_t *x;
+	long long now = sim_time_us();
+	long long end;
+	long long wake;
+
+	end = now + (tv != NULL ? tv->tv_sec * 1000000LL + tv->tv_usec : 60000000LL);
+
+	for (;;) {
+		done = NULL;
+		done_tail = &done;
+		wake = end;
+
+		for (sd = sim->devs; sd != NULL; sd = sd->next)
+			sim_dev_process(sd, now, &wake, &done_tail);
+
+		if (done != NULL) {
+			/* the callbacks may submit new transfers */
+			while ((x = done) != NULL) {
+				done = x->next;
+				x->transfer->callback(x->transfer);
+				free(x);
+			}
+			return 0;
+		}
+
+		if (now >= end)
+			return 0;
+
+		sim_sleep_us(wake - now);
+		now = sim_time_us();
+	}
+}
+
+static int sim_submit_transfer(vfs301_transport_t *tr, struct libusb_transfer *transfer)
+{
+	sim_dev_t *sd = tr->priv;
+	sim_xfer_t *x;
+	sim_xfer_t **px;
+	long long now = sim_time_us();
+
+	x = calloc(1, sizeof(*x));
+	if (x == NULL)
+		return LIBUSB_ERROR_NO_MEM;
+
+	x->transfer = transfer;
+	transfer->actual_length = 0;
+	if (transfer->timeout != 0)
+		x->deadline = now + transfer->timeout * 1000LL;
+
+	x->ready = now + sd->params.latency_us;
+	if (!(transfer->endpoint & LIBUSB_ENDPOINT_IN))
+		sim_command(sd, transfer->buffer, transfer->length, now);
+
+	for (px = &sd->xfers; *px != NULL; px = &(*px)->next)
+		;
+	*px = x;
+
+	return 0;
+}
+
+static int sim_cancel_transfer(vfs301_transport_t *tr, struct libusb_transfer *transfer)
+{
+	sim_dev_t *sd = tr->priv;
+	sim_xfer_t *x;
+
+	for (x = sd->xfers; x != NULL; x = x->next) {
+		if (x->transfer == transfer) {
+			x->cancelled = 1;
+			return 0;
+		}
+	}
+
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+static void sim_free(vfs301_transport_t *tr)
+{
+	sim_dev_t *sd = tr->priv;
+	sim_dev_t **psd;
+
+	for (psd = &sd->sim->devs; *psd != sd; psd = &(*psd)->next)
+		;
+	*psd = sd->next;
+
+	while (sd->xfers != NULL) {
+		sim_xfer_t *x = sd->xfers;
+
+		sd->xfers = x->next;
+		free(x);
+	}
+	sim_clear(&sd->ctrl);
+	sim_clear(&sd->data);
+	free(sd->own_swipe);
+	free(sd);
+}
+
+/************************** API ***********************************************/
+
+void vfs301_sim_params_default(vfs301_sim_params_t *params)
+{
+	memset(params, 0, sizeof(*params));
+	params->line_rate = 3000;
+	params->latency_us = 500;
+	params->finger_delay_ms = 1000;
+	params->empty_lines = 100;
+	params->mirror_lag = VFS301_FP_MIRROR_DIST;
+	params->strict_init = 1;
+}
+
+vfs301_sim_t *vfs301_sim_new(void)
+{
+	return calloc(1, sizeof(vfs301_sim_t));
+}
+
+void vfs301_sim_free(vfs301_sim_t *sim)
+{
+	assert(sim->devs == NULL);
+	free(sim);
+}
+
+vfs301_transport_t *vfs301_sim_device_new(
+	vfs301_sim_t *sim, const vfs301_sim_params_t *params)
+{
+	sim_dev_t *sd = calloc(1, sizeof(*sd));
+
+	if (sd == NULL)
+		return NULL;
+
+	sd->sim = sim;
+	sd->params = *params;
+	if (sd->params.swipe == NULL) {
+		sd->params.swipe_lines = VFS301_SIM_SYNTHETIC_LINES;
+		sd->own_swipe = vfs301_sim_swipe_synthetic(sd->params.swipe_lines, 301);
+		sd->params.swipe = sd->own_swipe;
+	}
+
+	sd->tr.submit_transfer = sim_submit_transfer;
+	sd->tr.cancel_transfer = sim_cancel_transfer;
+	sd->tr.handle_events = sim_handle_events;
+	sd->tr.free = sim_free;
+	sd->tr.priv = sd;
+
+	sd->next = sim->devs;
+	sim->devs = sd;
+
+	return &sd->tr;
+}
@@ -0,0 +1,85 @@
+/*
+ * vfs301/vfs300 fingerprint reader driver
+ * https://github.com/andree182/vfs301
+ *
+ * Copyright (c) 2011-2012 Andrej Krutak <dev@andree.sk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Software vfs301 simulator, usable as a vfs301_transport_t.
+ *
+ * It answers the init sequence, the 0x17 event polls and the scan requests;
+ * the finger appears finger_delay_ms after the scan was requested, and then
+ * the swipe is streamed as vfs301_line_t frames at line_rate, each transfer
+ * delayed by latency_us. Only the timing of the real device is modelled,
+ * the replies are made up (beside their lengths).
+ */
+
+typedef struct {
+	/* frames streamed per second during the scan, 0 = as fast as possible */
+	int line_rate;
+	/* latency of each transfer (us) */
+	int latency_us;
+	/* time from the scan request to the finger being detected (ms) */
+	int finger_delay_ms;
+	/* number of empty frames before and after the swipe */
+	int empty_lines;
+	/* frames the finger takes from the mirror row to the scanned one (see
+	 * VFS301_FP_MIRROR_DIST) - the finger moves at a constant speed, as far
+	 * as the mirror is concerned */
+	int mirror_lag;
+	/* the first half of every glitch_frames-th frame is cut out, as if
+	 * some data got lost on the way (0 = never) */
+	int glitch_frames;
+	/* every noise_scans-th scan is noise - the sums show the finger, but
+	 * the frames stay empty and flagged as bad (0 = never) */
+	int noise_scans;
+	/* send just noise, unless the white LED was turned on (0x24) and the
+	 * sensor calibrated (0x02D0, 0x0220/03) - a made-up rule, the real
+	 * requirements of the device are unknown */
+	int strict_init;
+
+	/* the swipe - VFS301_FP_WIDTH px scan lines, NULL = synthetic one */
+	const unsigned char *swipe;
+	int swipe_lines;
+} vfs301_sim_params_t;
+
+#define VFS301_SIM_SYNTHETIC_LINES (1500)
+
+/* Context shared by the simulated devices, like a libusb_context */
+typedef struct vfs301_sim vfs301_sim_t;
+
+void vfs301_sim_params_default(vfs301_sim_params_t *params);
+
+vfs301_sim_t *vfs301_sim_new(void);
+void vfs301_sim_free(vfs301_sim_t *sim);
+
+/** Returns a new simulated device, freed by vfs301_transport_free() */
+vfs301_transport_t *vfs301_sim_device_new(
+	vfs301_sim_t *sim, const vfs301_sim_params_t *params);
+
+/** Fill in a frame as sent by the device; finger = 0 for an empty one */
+void vfs301_sim_frame(
+	vfs301_line_t *frame, const unsigned char *scan, int counter, int finger);
+
+/** A fake swipe - ridges moving by a random speed, plus some noise.
+ * Returns lines * VFS301_FP_WIDTH bytes, to be freed by the caller. */
+unsigned char *vfs301_sim_swipe_synthetic(int lines, unsigned int seed);
+
+/** Loads the scan lines of a PGM stored by the cli - either the 200 px wide
+ * scans, or the 288 px wide raw frames (OUTPUT_RAW). Returns NULL on error. */
+unsigned char *vfs301_sim_swipe_load(const char *fn, int *lines);
@@ -0,0 +1,113 @@
+/*
+ * vfs301/vfs300 fingerprint reader driver
+ * https://github.com/andree182/vfs301
+ *
+ * Copyright (c) 2011-2012 Andrej Krutak <dev@andree.sk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdlib.h>
+#include <libusb-1.0/libusb.h>
+
+#include "vfs301_transport.h"
+
+/************************** LIBUSB TRANSPORT **********************************/
+
+typedef struct {
+	struct libusb_context *ctx;
+	struct libusb_device_handle *devh;
+} libusb_priv_t;
+
+static int libusb_tr_submit_transfer(
+	vfs301_transport_t *tr, struct libusb_transfer *transfer)
+{
+	libusb_priv_t *priv = tr->priv;
+
+	transfer->dev_handle = priv->devh;
+	return libusb_submit_transfer(transfer);
+}
+
+static int libusb_tr_cancel_transfer(
+	vfs301_transport_t *tr, struct libusb_transfer *transfer)
+{
+	return libusb_cancel_transfer(transfer);
+}
+
+static int libusb_tr_handle_events(vfs301_transport_t *tr, struct timeval *tv)
+{
+	libusb_priv_t *priv = tr->priv;
+
+	return libusb_handle_events_timeout(priv->ctx, tv);
+}
+
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+static unsigned char *libusb_tr_dev_mem_alloc(vfs301_transport_t *tr, size_t length)
+{
+	libusb_priv_t *priv = tr->priv;
+
+	return libusb_dev_mem_alloc(priv->devh, length);
+}
+
+static void libusb_tr_dev_mem_free(
+	vfs301_transport_t *tr, unsigned char *buf, size_t length)
+{
+	libusb_priv_t *priv = tr->priv;
+
+	libusb_dev_mem_free(priv->devh, buf, length);
+}
+#endif
+
+static void libusb_tr_free(vfs301_transport_t *tr)
+{
+	free(tr->priv);
+	free(tr);
+}
+
+vfs301_transport_t *vfs301_transport_libusb_new(
+	struct libusb_context *ctx, struct libusb_device_handle *devh)
+{
+	vfs301_transport_t *tr;
+	libusb_priv_t *priv;
+
+	tr = calloc(1, sizeof(*tr));
+	priv = calloc(1, sizeof(*priv));
+	if (tr == NULL || priv == NULL) {
+		free(tr);
+		free(priv);
+		return NULL;
+	}
+
+	priv->ctx = ctx;
+	priv->devh = devh;
+
+	tr->submit_transfer = libusb_tr_submit_transfer;
+	tr->cancel_transfer = libusb_tr_cancel_transfer;
+	tr->handle_events = libusb_tr_handle_events;
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+	tr->dev_mem_alloc = libusb_tr_dev_mem_alloc;
+	tr->dev_mem_free = libusb_tr_dev_mem_free;
+#endif
+	tr->free = libusb_tr_free;
+	tr->priv = priv;
+
+	return tr;
+}
+
+void vfs301_transport_free(vfs301_transport_t *tr)
+{
+	if (tr != NULL)
+		tr->free(tr);
+}
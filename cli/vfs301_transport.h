@@ -0,0 +1,56 @@
+/*
+ * vfs301/vfs300 fingerprint reader driver
+ * https://github.com/andree182/vfs301
+ *
+ * Copyright (c) 2011-2012 Andrej Krutak <dev@andree.sk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * The USB transport used by the protocol code. By default (no transport set
+ * in vfs301_dev_t) libusb is used directly on vfs301_dev_t::devh, but the
+ * device may be swapped e.g. for the simulator (vfs301_sim.h).
+ *
+ * Asynchronous transfers are still described by struct libusb_transfer
+ * (allocated by libusb_alloc_transfer()), the transport just decides where
+ * they go. The semantics of all the calls are the same as of the libusb
+ * functions with the same names.
+ */
+#include <stddef.h>
+#include <sys/time.h>
+#include <libusb-1.0/libusb.h>
+
+typedef struct vfs301_transport vfs301_transport_t;
+
+struct vfs301_transport {
+	int (*submit_transfer)(vfs301_transport_t *tr, struct libusb_transfer *transfer);
+	int (*cancel_transfer)(vfs301_transport_t *tr, struct libusb_transfer *transfer);
+	/* Handles the events of all the devices sharing the context with this one */
+	int (*handle_events)(vfs301_transport_t *tr, struct timeval *tv);
+	/* Buffers the device can DMA into (libusb_dev_mem_alloc()) - optional,
+	 * the ops may be NULL or return NULL, malloc() is used then */
+	unsigned char *(*dev_mem_alloc)(vfs301_transport_t *tr, size_t length);
+	void (*dev_mem_free)(vfs301_transport_t *tr, unsigned char *buf, size_t length);
+	void (*free)(vfs301_transport_t *tr);
+
+	void *priv;
+};
+
+/** Transport for a real device opened via libusb */
+vfs301_transport_t *vfs301_transport_libusb_new(
+	struct libusb_context *ctx, struct libusb_device_handle *devh);
+
+void vfs301_transport_free(vfs301_transport_t *tr);
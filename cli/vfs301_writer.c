@@ -0,0 +1,381 @@
+/*
+ * vfs301/vfs300 fingerprint reader driver
+ * https://github.com/andree182/vfs301
+ *
+ * Copyright (c) 2011-2012 Andrej Krutak <dev@andree.sk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <libusb-1.0/libusb.h>
+
+#include "vfs301_proto.h"
+#include "vfs301_archive.h"
+#include "vfs301_writer.h"
+
+typedef struct {
+	unsigned char *buf;
+	vfs301_archive_scan_t scan;
+	/* the raw frames of the scan, if any (in buf too) */
+	vfs301_raw_frames_t raw;
+	int has_raw;
+	char fn[64];
+} writer_slot_t;
+
+struct vfs301_writer {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	/* signalled when an image is queued, or a buffer is freed */
+	pthread_cond_t cond;
+	vfs301_archive_writer_t *archive;
+	int lines;
+	int line_size;
+	/* the counters of the raw frames, as stored */
+	unsigned char *counters;
+
+	/* the buffers - the free ones, and the ones queued (a ring) */
+	writer_slot_t *slots;
+	int count;
+	int *free_slots;
+	int free_count;
+	int *queue;
+	/* the batch being written */
+	int *batch;
+	int queue_head;
+	int queue_count;
+	/* set while a batch is being written */
+	int writing;
+	int stopping;
+
+	vfs301_writer_stats_t stats;
+};
+
+static int writer_slot(vfs301_writer_t *w, const unsigned char *buf)
+{
+	int i;
+
+	for (i = 0; i < w->count; i++) {
+		if (w->slots[i].buf == buf)
+			return i;
+	}
+
+	assert(!"not a buffer of the writer");
+	return -1;
+}
+
+static void writer_pgm(FILE *f, const vfs301_archive_scan_t *scan)
+{
+	fprintf(f, "P5\n%d %d\n255\n", scan->width, scan->height);
+	fwrite(scan->data, scan->height * scan->width, 1, f);
+}
+
+/** The raw frames as they were received, one per line */
+static void writer_raw_pgm(FILE *f, const vfs301_raw_frames_t *raw)
+{
+	vfs301_line_t frame;
+	int i;
+
+	fprintf(f, "P5\n%d %d\n255\n", VFS301_FP_FRAME_SIZE, raw->count);
+	for (i = 0; i < raw->count; i++) {
+		vfs301_raw_frame(raw, i, &frame);
+		fwrite(&frame, sizeof(frame), 1, f);
+	}
+}
+
+/** The raw frames go to the file with "_raw" added to its name */
+static int writer_raw_file(const writer_slot_t *slot)
+{
+	char fn[sizeof(slot->fn) + 8];
+	int len = strlen(slot->fn);
+	FILE *f;
+
+	if (len > 4 && strcmp(slot->fn + len - 4, ".pgm") == 0)
+		len -= 4;
+	snprintf(fn, sizeof(fn), "%.*s_raw.pgm", len, slot->fn);
+
+	f = fopen(fn, "wb");
+	if (f == NULL) {
+		fprintf(stderr, "Can't write %s\n", fn);
+		return -1;
+	}
+	writer_raw_pgm(f, &slot->raw);
+	return fclose(f) == 0 ? 0 : -1;
+}
+
+/** The raw frames go to the archive by their fields, as they are kept */
+static int writer_raw_archive(vfs301_writer_t *w, const writer_slot_t *slot)
+{
+	const vfs301_raw_frames_t *raw = &slot->raw;
+	vfs301_archive_scan_t scan = slot->scan;
+	const unsigned char *parts[VFS301_COLUMNS];
+	size_t lens[VFS301_COLUMNS];
+	int i;
+
+	scan.flags |= VFS301_ARCHIVE_RAW | VFS301_ARCHIVE_COLUMNS;
+	scan.width = VFS301_FP_RAW_SIZE;
+	scan.height = raw->count;
+
+	/* little endian, whatever the host is */
+	for (i = 0; i < raw->count; i++) {
+		w->counters[2 * i] = raw->counter[i] & 0xFF;
+		w->counters[2 * i + 1] = raw->counter[i] >> 8;
+	}
+
+	parts[VFS301_COLUMN_COUNTER] = w->counters;
+	lens[VFS301_COLUMN_COUNTER] = 2 * raw->count;
+	parts[VFS301_COLUMN_FLAGS] = raw->flags;
+	lens[VFS301_COLUMN_FLAGS] = raw->count;
+	parts[VFS301_COLUMN_SCAN] = raw->scan;
+	lens[VFS301_COLUMN_SCAN] = VFS301_FP_WIDTH * raw->count;
+	parts[VFS301_COLUMN_MIRROR] = raw->mirror;
+	lens[VFS301_COLUMN_MIRROR] = VFS301_FP_RAW_MIRROR * raw->count;
+	parts[VFS301_COLUMN_SUMS] = raw->sums;
+	lens[VFS301_COLUMN_SUMS] = VFS301_FP_RAW_SUMS * raw->count;
+
+	return vfs301_archive_append_parts(w->archive, &scan, parts, lens, VFS301_COLUMNS);
+}
+
+/** Writes a batch of images, returns the number of failures */
+static int writer_write(vfs301_writer_t *w, const int *batch, int count)
+{
+	writer_slot_t *slot;
+	FILE *f;
+	int errors = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		slot = &w->slots[batch[i]];
+
+		if (w->archive != NULL) {
+			if (vfs301_archive_append(w->archive, &slot->scan) < 0 ||
+				(slot->has_raw && writer_raw_archive(w, slot) < 0))
+				errors++;
+			continue;
+		}
+
+		f = fopen(slot->fn, "wb");
+		if (f == NULL) {
+			fprintf(stderr, "Can't write %s\n", slot->fn);
+			errors++;
+			continue;
+		}
+		writer_pgm(f, &slot->scan);
+		if (fclose(f) != 0 || (slot->has_raw && writer_raw_file(slot) < 0))
+			errors++;
+	}
+
+	/* the whole batch goes out at once */
+	if (w->archive != NULL && vfs301_archive_flush(w->archive) < 0)
+		errors = count;
+
+	return errors;
+}
+
+static void *writer_thread(void *arg)
+{
+	vfs301_writer_t *w = arg;
+	int *batch = w->batch;
+	int count;
+	int errors;
+	int i;
+
+	pthread_mutex_lock(&w->lock);
+
+	for (;;) {
+		while (w->queue_count == 0 && !w->stopping)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if (w->queue_count == 0)
+			break;
+
+		/* take all that is queued */
+		for (count = 0; w->queue_count > 0; count++) {
+			batch[count] = w->queue[w->queue_head];
+			w->queue_head = (w->queue_head + 1) % w->count;
+			w->queue_count--;
+		}
+		w->writing = 1;
+
+		pthread_mutex_unlock(&w->lock);
+		errors = writer_write(w, batch, count);
+		pthread_mutex_lock(&w->lock);
+
+		w->writing = 0;
+		for (i = 0; i < count; i++)
+			w->free_slots[w->free_count++] = batch[i];
+		w->stats.written += count - errors;
+		w->stats.errors += errors;
+		w->stats.batches++;
+		if (count > w->stats.max_batch)
+			w->stats.max_batch = count;
+		pthread_cond_broadcast(&w->cond);
+	}
+
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+vfs301_writer_t *vfs301_writer_new(
+	const char *archive, int lines, int line_size, int buffers)
+{
+	vfs301_writer_t *w = calloc(1, sizeof(*w));
+	int i;
+
+	if (w == NULL)
+		return NULL;
+
+	w->lines = lines;
+	w->line_size = line_size;
+	w->count = buffers;
+	w->slots = calloc(buffers, sizeof(*w->slots));
+	w->free_slots = calloc(buffers, sizeof(*w->free_slots));
+	w->queue = calloc(buffers, sizeof(*w->queue));
+	w->batch = calloc(buffers, sizeof(*w->batch));
+	w->counters = malloc(2 * lines);
+	if (w->slots == NULL || w->free_slots == NULL || w->queue == NULL ||
+		w->batch == NULL || w->counters == NULL)
+		goto fail;
+
+	/* the buffers are allocated once needed */
+	for (i = 0; i < buffers; i++)
+		w->free_slots[w->free_count++] = buffers - 1 - i;
+
+	if (archive != NULL) {
+		w->archive = vfs301_archive_append_start(archive);
+		if (w->archive == NULL)
+			goto fail;
+	}
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	if (pthread_create(&w->thread, NULL, writer_thread, w) != 0) {
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->lock);
+		if (w->archive != NULL)
+			vfs301_archive_append_end(w->archive);
+		goto fail;
+	}
+
+	return w;
+
+fail:
+	free(w->slots);
+	free(w->free_slots);
+	free(w->queue);
+	free(w->batch);
+	free(w->counters);
+	free(w);
+	return NULL;
+}
+
+void vfs301_writer_free(vfs301_writer_t *w)
+{
+	int i;
+
+	pthread_mutex_lock(&w->lock);
+	w->stopping = 1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+
+	if (w->archive != NULL && vfs301_archive_append_end(w->archive) < 0)
+		fprintf(stderr, "Can't write the index of the archive\n");
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+
+	for (i = 0; i < w->count; i++)
+		free(w->slots[i].buf);
+	free(w->slots);
+	free(w->free_slots);
+	free(w->queue);
+	free(w->batch);
+	free(w->counters);
+	free(w);
+}
+
+void vfs301_writer_flush(vfs301_writer_t *w)
+{
+	pthread_mutex_lock(&w->lock);
+	while (w->queue_count > 0 || w->writing)
+		pthread_cond_wait(&w->cond, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+}
+
+unsigned char *vfs301_writer_get(vfs301_writer_t *w)
+{
+	writer_slot_t *slot;
+
+	pthread_mutex_lock(&w->lock);
+
+	if (w->free_count == 0)
+		w->stats.waits++;
+	while (w->free_count == 0)
+		pthread_cond_wait(&w->cond, &w->lock);
+	slot = &w->slots[w->free_slots[--w->free_count]];
+	if (slot->buf == NULL) {
+		slot->buf = malloc((size_t)w->lines * w->line_size);
+		assert(slot->buf != NULL);
+	}
+
+	pthread_mutex_unlock(&w->lock);
+	return slot->buf;
+}
+
+int vfs301_writer_lines(vfs301_writer_t *w)
+{
+	return w->lines;
+}
+
+void vfs301_writer_put(
+	vfs301_writer_t *w, const vfs301_archive_scan_t *scan,
+	const vfs301_raw_frames_t *raw, const char *fn)
+{
+	int i;
+
+	pthread_mutex_lock(&w->lock);
+
+	i = writer_slot(w, scan->data);
+	w->slots[i].scan = *scan;
+	w->slots[i].has_raw = raw != NULL;
+	if (raw != NULL)
+		w->slots[i].raw = *raw;
+	snprintf(w->slots[i].fn, sizeof(w->slots[i].fn), "%s", fn);
+
+	assert(w->queue_count < w->count);
+	w->queue[(w->queue_head + w->queue_count) % w->count] = i;
+	w->queue_count++;
+	pthread_cond_broadcast(&w->cond);
+
+	pthread_mutex_unlock(&w->lock);
+}
+
+void vfs301_writer_release(vfs301_writer_t *w, unsigned char *buf)
+{
+	pthread_mutex_lock(&w->lock);
+	w->free_slots[w->free_count++] = writer_slot(w, buf);
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+void vfs301_writer_stats(vfs301_writer_t *w, vfs301_writer_stats_t *stats)
+{
+	pthread_mutex_lock(&w->lock);
+	*stats = w->stats;
+	pthread_mutex_unlock(&w->lock);
+}
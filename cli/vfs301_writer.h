@@ -0,0 +1,74 @@
+/*
+ * vfs301/vfs300 fingerprint reader driver
+ * https://github.com/andree182/vfs301
+ *
+ * Copyright (c) 2011-2012 Andrej Krutak <dev@andree.sk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Background writer of the scans. The images are built right in the buffers
+ * of the writer (see vfs301_dev_t::img_output), and queued to it once the
+ * scan is over - a thread of its own writes them out in batches, while the
+ * capture goes on. Each image goes either to a PGM file of its own, or all
+ * of them are appended to an archive (see vfs301_archive.h).
+ *
+ * The buffers are limited; when all of them are queued, getting the next
+ * one waits for the writer.
+ */
+
+/* Images that may wait in the queue, beside the ones being scanned to */
+#define VFS301_WRITER_QUEUE (8)
+
+typedef struct vfs301_writer vfs301_writer_t;
+
+typedef struct {
+	/* images written, in how many batches, and the largest batch */
+	int written;
+	int batches;
+	int max_batch;
+	/* times the capture had to wait for a free buffer */
+	int waits;
+	/* images that couldn't be written */
+	int errors;
+} vfs301_writer_stats_t;
+
+/** Starts the writer thread, with the given number of buffers of lines
+ * lines of line_size bytes each. The images are appended to archive if it
+ * is set (the file is opened right away), or written to the files they are
+ * queued with. Returns NULL on error. */
+vfs301_writer_t *vfs301_writer_new(
+	const char *archive, int lines, int line_size, int buffers);
+/** Writes out the queued images, and stops the writer */
+void vfs301_writer_free(vfs301_writer_t *writer);
+/** Waits until all the queued images are written */
+void vfs301_writer_flush(vfs301_writer_t *writer);
+
+/** Returns a free buffer (waits for one if needed) */
+unsigned char *vfs301_writer_get(vfs301_writer_t *writer);
+/** Capacity of the buffers, in lines */
+int vfs301_writer_lines(vfs301_writer_t *writer);
+/** Queues the scan to be written to the file fn (unless there is an
+ * archive) - its data have to be in a buffer of the writer, which takes
+ * the buffer back. The raw frames (if not NULL, in the same buffer) are
+ * written to the archive as well, or to fn with "_raw" added. */
+void vfs301_writer_put(
+	vfs301_writer_t *writer, const vfs301_archive_scan_t *scan,
+	const vfs301_raw_frames_t *raw, const char *fn);
+/** Gives the buffer back without writing it */
+void vfs301_writer_release(vfs301_writer_t *writer, unsigned char *buf);
+
+void vfs301_writer_stats(vfs301_writer_t *writer, vfs301_writer_stats_t *stats);